@@ -0,0 +1,192 @@
+/* hist_bench -- time read_history and write_history on large history files */
+
+/* Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This file is part of the GNU Readline Library (Readline), a library for
+   reading lines of text with interactive input and history editing.
+
+   Readline is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Readline is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Readline.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef READLINE_LIBRARY
+#define READLINE_LIBRARY 1
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef READLINE_LIBRARY
+#  include "history.h"
+#else
+#  include <readline/history.h>
+#endif
+
+static void
+usage()
+{
+  fprintf (stderr, "hist_bench: usage: hist_bench [-a] [-l] [-d directory] [lines ...]\n");
+  exit (2);
+}
+
+static double
+now ()
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, 0);
+  return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/* Write a history file of NLINES made-up commands to FN, each preceded by
+   a timestamp line if TIMESTAMPS is non-zero.  The lines vary in length
+   the way a shell history does. */
+static int
+make_file (fn, nlines, timestamps)
+     char *fn;
+     long nlines;
+     int timestamps;
+{
+  static const char *cmds[] = {
+    "ls -l", "cd ..", "make -j8 all", "git status", "vi src/file%ld.c",
+    "grep -rn pattern%ld include/ lib/ src/", "echo $PATH",
+    "ssh host%ld.example.com 'tail -f /var/log/messages'",
+    "for f in *.c; do gcc -O2 -c $f -o ${f%%.c}.o; done # %ld",
+  };
+  FILE *fp;
+  long i;
+
+  if ((fp = fopen (fn, "w")) == 0)
+    return (errno);
+  for (i = 0; i < nlines; i++)
+    {
+      if (timestamps)
+	fprintf (fp, "#%ld\n", 1600000000L + i);
+      fprintf (fp, cmds[i % (sizeof (cmds) / sizeof (cmds[0]))], i);
+      putc ('\n', fp);
+    }
+  if (fclose (fp) != 0)
+    return (errno);
+  return (0);
+}
+
+static int
+run (dir, nlines, timestamps)
+     char *dir;
+     long nlines;
+     int timestamps;
+{
+  char infile[1024], outfile[1024];
+  struct stat st;
+  double t0, tread, twrite;
+  int r;
+
+  snprintf (infile, sizeof (infile), "%s/hist_bench.%ld.%d", dir, nlines, timestamps);
+  snprintf (outfile, sizeof (outfile), "%s/hist_bench.%ld.%d.out", dir, nlines, timestamps);
+
+  if ((r = make_file (infile, nlines, timestamps)) != 0)
+    {
+      fprintf (stderr, "hist_bench: %s: %s\n", infile, strerror (r));
+      return (1);
+    }
+  stat (infile, &st);
+
+  /* Reading a file with timestamps sets history_multiline_entries, which
+     would make every line of the next file without them a continuation of
+     the one before. */
+  history_comment_char = timestamps ? '#' : '\0';
+  history_write_timestamps = timestamps;
+  history_multiline_entries = 0;
+
+  t0 = now ();
+  r = read_history (infile);
+  tread = now () - t0;
+  if (r != 0)
+    {
+      fprintf (stderr, "hist_bench: read_history: %s: %s\n", infile, strerror (r));
+      unlink (infile);
+      return (1);
+    }
+
+  t0 = now ();
+  r = write_history (outfile);
+  twrite = now () - t0;
+  if (r != 0)
+    fprintf (stderr, "hist_bench: write_history: %s: %s\n", outfile, strerror (r));
+
+  printf ("%10ld %-10s %10ld %10.3f %10.3f\n", nlines,
+	  timestamps ? "yes" : "no", (long)st.st_size / 1024, tread, twrite);
+  fflush (stdout);
+
+  clear_history ();
+  unlink (infile);
+  unlink (outfile);
+  return (r != 0);
+}
+
+int
+main (argc, argv)
+     int argc;
+     char **argv;
+{
+  static char *defsizes[] = { "100000", "1000000", "10000000", 0 };
+  char *dir, **sizes;
+  long nlines;
+  int r, i, status;
+
+  dir = getenv ("TMPDIR");
+  if (dir == 0 || *dir == '\0')
+    dir = "/tmp";
+
+  while ((r = getopt (argc, argv, "ad:l")) != -1)
+    {
+      switch (r)
+	{
+	case 'a':
+	  history_use_arena = 1;
+	  break;
+	case 'd':
+	  dir = optarg;
+	  break;
+	case 'l':
+	  history_lazy_read = 1;
+	  break;
+	default:
+	  usage ();
+	}
+    }
+  argv += optind;
+  argc -= optind;
+
+  sizes = argc ? argv : defsizes;
+
+  printf ("%10s %-10s %10s %10s %10s\n", "lines", "timestamps", "size (KB)",
+	  "read (s)", "write (s)");
+  status = 0;
+  for (i = 0; sizes[i]; i++)
+    {
+      nlines = strtol (sizes[i], 0, 10);
+      if (nlines <= 0)
+	usage ();
+      status |= run (dir, nlines, 0);
+      status |= run (dir, nlines, 1);
+    }
+
+  exit (status);
+}
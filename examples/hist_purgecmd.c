@@ -108,14 +108,35 @@ main (argc, argv)
   exit (0);
 }
 
+struct purge_spec
+{
+  char *cmd;
+  int flags;
+  regex_t *regex;
+};
+
+static int
+purge_match (ent, arg)
+     HIST_ENTRY *ent;
+     void *arg;
+{
+  struct purge_spec *spec;
+
+  spec = (struct purge_spec *)arg;
+  if (spec->flags & PURGE_REGEXP)
+    return (regexec (spec->regex, ent->line, 0, 0, 0) == 0);
+  return (STREQ (ent->line, spec->cmd));
+}
+
 int
 hist_purgecmd (cmd, flags)
      char *cmd;
      int flags;
 {
-  int r, n, rflags;
-  HIST_ENTRY *temp;
+  int r, rflags;
+  HIST_ENTRY **removed;
   regex_t regex = { 0 };
+  struct purge_spec spec;
 
   if (flags & PURGE_REGEXP)
     {
@@ -127,22 +148,20 @@ hist_purgecmd (cmd, flags)
 	}
     }
 
-  r = 0;
-  using_history ();
-  r = where_history ();
-  for (n = 0; n < r; n++)
+  /* Remove all the matching entries in one pass rather than calling
+     remove_history for each one. */
+  spec.cmd = cmd;
+  spec.flags = flags;
+  spec.regex = &regex;
+  removed = history_remove_if (purge_match, &spec);
+  if (removed)
     {
-      temp = history_get (n+history_base);
-      if (((flags & PURGE_REGEXP) && (regexec (&regex, temp->line, 0, 0, 0) == 0)) ||
-	  ((flags & PURGE_REGEXP) == 0 && STREQ (temp->line, cmd)))
-	{
-	  remove_history (n);
-	  r--;			/* have to get one fewer now */
-	  n--;			/* compensate for above increment */
-	  history_offset--;	/* moving backwards in history list */
-	}
+      for (r = 0; removed[r]; r++)
+	free_history_entry (removed[r]);
+      free (removed);
     }
   using_history ();
+  r = where_history ();
 
   if (flags & PURGE_REGEXP)
     regfree (&regex);
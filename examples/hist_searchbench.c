@@ -0,0 +1,212 @@
+/* hist_searchbench -- time history_search_pos against the old search loop */
+
+/* Copyright (C) 2011 Free Software Foundation, Inc.
+
+   This file is part of the GNU Readline Library (Readline), a library for
+   reading lines of text with interactive input and history editing.
+
+   Readline is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Readline is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Readline.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef READLINE_LIBRARY
+#define READLINE_LIBRARY 1
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#ifdef READLINE_LIBRARY
+#  include "history.h"
+#else
+#  include <readline/history.h>
+#endif
+
+#define STREQN(a, b, n) ((n == 0) ? (1) \
+                                  : ((a)[0] == (b)[0] && strncmp(a, b, n) == 0))
+
+static void
+usage()
+{
+  fprintf (stderr, "hist_searchbench: usage: hist_searchbench [-j threads] [-l length] [-n entries] [-r repeat] [string ...]\n");
+  exit (2);
+}
+
+static double
+now ()
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, 0);
+  return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/* The substring search history_search used to do: a strlen of each line,
+   then a strncmp at every offset in it.  Returns the offset of the entry
+   found, like history_search_pos. */
+static int
+old_search_pos (string, dir, pos)
+     const char *string;
+     int dir, pos;
+{
+  HIST_ENTRY **the_history;
+  char *line;
+  int i, line_index, string_len, limit;
+
+  the_history = history_list ();
+  string_len = strlen (string);
+  for (i = pos; dir < 0 ? i >= 0 : i < history_length; dir < 0 ? i-- : i++)
+    {
+      line = the_history[i]->line;
+      line_index = strlen (line);
+
+      if (string_len > line_index)
+	continue;
+
+      if (dir < 0)
+	{
+	  for (line_index -= string_len; line_index >= 0; line_index--)
+	    if (STREQN (string, line + line_index, string_len))
+	      return (i);
+	}
+      else
+	{
+	  limit = line_index - string_len + 1;
+	  for (line_index = 0; line_index < limit; line_index++)
+	    if (STREQN (string, line + line_index, string_len))
+	      return (i);
+	}
+    }
+  return (-1);
+}
+
+/* Add NENTRIES made-up commands to the history list, padded with
+   arguments to at least MINLEN characters. */
+static void
+make_history (nentries, minlen)
+     long nentries;
+     int minlen;
+{
+  static const char *cmds[] = {
+    "ls -l", "cd ..", "make -j8 all", "git status", "vi src/file%ld.c",
+    "grep -rn pattern%ld include/ lib/ src/", "echo $PATH",
+    "ssh host%ld.example.com 'tail -f /var/log/messages'",
+    "for f in *.c; do gcc -O2 -c $f -o ${f%%.c}.o; done # %ld",
+  };
+  static const char filler[] = " --verbose --output=build/out.log";
+  char *buf;
+  long i;
+  int len;
+
+  buf = malloc (minlen + 256);
+  for (i = 0; i < nentries; i++)
+    {
+      len = snprintf (buf, 256, cmds[i % (sizeof (cmds) / sizeof (cmds[0]))], i);
+      while (len < minlen)
+	{
+	  strcpy (buf + len, filler);
+	  len += sizeof (filler) - 1;
+	}
+      add_history (buf);
+    }
+  free (buf);
+}
+
+static void
+run (string, dir, repeat)
+     char *string;
+     int dir, repeat;
+{
+  double t0, told, tnew;
+  int pos, rold, rnew, n;
+
+  pos = dir < 0 ? history_length - 1 : 0;
+
+  t0 = now ();
+  for (n = 0; n < repeat; n++)
+    rold = old_search_pos (string, dir, pos);
+  told = (now () - t0) / repeat;
+
+  t0 = now ();
+  for (n = 0; n < repeat; n++)
+    rnew = history_search_pos (string, dir, pos);
+  tnew = (now () - t0) / repeat;
+
+  printf ("%-24s %-8s %10d %10.2f %10.2f %8.1fx%s\n", string,
+	  dir < 0 ? "reverse" : "forward", rnew, told * 1000, tnew * 1000,
+	  tnew > 0 ? told / tnew : 0.0, rold != rnew ? "  MISMATCH" : "");
+  fflush (stdout);
+}
+
+int
+main (argc, argv)
+     int argc;
+     char **argv;
+{
+  /* Strings that aren't there, so both loops look at every line, and
+     strings found only near the far end of the list. */
+  static char *defstrings[] = { "frobnicate", "qz", "/var/log/syslog",
+				"src/file13.c", "pattern5 ", 0 };
+  char **strings;
+  long nentries;
+  int r, i, repeat, minlen;
+
+  nentries = 1000000;
+  minlen = 0;
+  repeat = 5;
+  while ((r = getopt (argc, argv, "j:l:n:r:")) != -1)
+    {
+      switch (r)
+	{
+	case 'j':
+	  history_search_threads = atoi (optarg);
+	  break;
+	case 'l':
+	  if ((minlen = atoi (optarg)) < 0 || minlen > 65536)
+	    usage ();
+	  break;
+	case 'n':
+	  if ((nentries = strtol (optarg, 0, 10)) <= 0)
+	    usage ();
+	  break;
+	case 'r':
+	  if ((repeat = atoi (optarg)) <= 0)
+	    usage ();
+	  break;
+	default:
+	  usage ();
+	}
+    }
+  argv += optind;
+  argc -= optind;
+
+  strings = argc ? argv : defstrings;
+
+  make_history (nentries, minlen);
+
+  printf ("%ld entries of at least %d characters, times are the mean of %d searches\n",
+	  nentries, minlen, repeat);
+  printf ("%-24s %-8s %10s %10s %10s %9s\n", "string", "direction", "found",
+	  "old (ms)", "new (ms)", "speedup");
+  for (i = 0; strings[i]; i++)
+    {
+      run (strings[i], -1, repeat);
+      run (strings[i], 1, repeat);
+    }
+
+  clear_history ();
+  exit (0);
+}
@@ -98,6 +98,7 @@ static const FUNMAP default_funmap[] = {
   { "forward-char", rl_forward_char },
   { "forward-search-history", rl_forward_search_history },
   { "forward-word", rl_forward_word },
+  { "fuzzy-search-history", rl_fuzzy_search_history },
   { "history-search-backward", rl_history_search_backward },
   { "history-search-forward", rl_history_search_forward },
   { "history-substring-search-backward", rl_history_substr_search_backward },
@@ -156,6 +156,7 @@ get_history_event (const char *string, int *caller_index, int delimiting_quote)
 
      All values N are determined via HISTORY_BASE. */
 
+  _hs_history_sweep ();
   i = *caller_index;
 
   if (string[i] != history_expansion_char)
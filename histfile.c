@@ -81,6 +81,19 @@
 
 #endif /* HISTORY_USE_MMAP */
 
+#if defined (HISTORY_USE_SHARED)
+#  if !defined (HISTORY_USE_MMAP)
+#    include <sys/mman.h>
+#  endif
+#  ifndef MAP_FAILED
+#    define MAP_FAILED	((void *)-1)
+#  endif
+#endif
+
+#if defined (HISTORY_USE_PTHREADS)
+#  include <pthread.h>
+#endif
+
 #if defined(_WIN32)
 #  define WIN32_LEAN_AND_MEAN
 #  include <windows.h>
@@ -127,6 +140,37 @@ int history_write_timestamps = 0;
    entries. Used by read_history_range */
 int history_multiline_entries = 0;
 
+/* If non-zero, read_history() allocates each entry it reads, together with
+   its line and timestamp, from large blocks of memory shared with the other
+   entries read from the file, rather than making separate allocations. */
+int history_use_arena = 0;
+
+/* If non-zero, keep an index of line offsets in FILENAME.idx alongside the
+   history file, so read_history_range() can go directly to the line it
+   wants to start reading at. */
+int history_use_index = 0;
+
+/* If non-zero, read_history() only finds where each entry is when it reads
+   the whole file into an empty history list; the newest entries are made
+   into HIST_ENTRYs at once, and the rest as the history list is walked
+   back to them.  The file stays mapped, or read into memory, until then. */
+int history_lazy_read = 0;
+
+/* If non-zero, append_history() queues the entries it's asked to append
+   and writes them later in batches.  history_flush() writes everything
+   still queued; the application has to call it before exiting. */
+int history_async_append = 0;
+
+/* Write the queued entries once this many are waiting... */
+int history_append_batch = 32;
+
+/* ...or once the oldest has waited this many milliseconds.  Without a
+   worker thread, this is only checked when more entries are queued. */
+int history_append_latency = 1000;
+
+/* If non-zero, fsync the history file after writing each batch. */
+int history_append_fsync = 0;
+
 /* Immediately after a call to read_history() or read_history_range(), this
    will return the number of lines just read from the history file in that
    call. */
@@ -137,6 +181,121 @@ int history_lines_read_from_file = 0;
    call.  This also works with history_truncate_file. */
 int history_lines_written_to_file = 0;
 
+/* The history file index records where every HISTORY_INDEX_STRIDE'th line
+   of the history file begins, counting lines the way read_history_range
+   does.  It covers the file up to the last newline it could classify, and
+   is extended when the history file grows and rebuilt if the file is
+   replaced or rewritten. */
+#define HISTORY_INDEX_MAGIC	0x48494458	/* "HIDX" */
+#define HISTORY_INDEX_VERSION	1
+#define HISTORY_INDEX_STRIDE	256
+#define HISTORY_INDEX_TAIL	256		/* bytes hashed to detect rewrites */
+
+typedef struct _hist_index_point {
+  off_t nl;		/* offset of the newline before the line */
+  off_t ts;		/* offset of the last timestamp seen before it, or -1 */
+} HIST_INDEX_POINT;
+
+typedef struct _hist_index_header {
+  unsigned int magic;
+  int version;
+  int hsize;		/* sizeof (HIST_INDEX_HEADER); rejects other ABIs */
+  int comment_char;	/* history_comment_char used to count the lines */
+  dev_t dev;
+  ino_t ino;
+  off_t scanned;	/* newlines before this offset have been counted */
+  off_t last_ts;	/* offset of the last timestamp before SCANNED, or -1 */
+  int lines;		/* number of lines counted */
+  int npoints;
+  unsigned int tailhash;	/* of the HISTORY_INDEX_TAIL bytes before SCANNED */
+} HIST_INDEX_HEADER;
+
+typedef struct _hist_index {
+  HIST_INDEX_HEADER h;
+  HIST_INDEX_POINT *points;	/* points[i] is line (i+1)*HISTORY_INDEX_STRIDE */
+  int psize;
+} HIST_INDEX;
+
+/* history_truncate_file and history_do_write read and write the history
+   file in blocks this big, so they never need more memory than this no
+   matter how big the file or the history list is. */
+#define HISTORY_BLOCK_SIZE	65536
+
+/* An entry append_history() has queued to be written to FILENAME.  The
+   settings that affect the write are copied when it's queued, since the
+   worker thread can't look at the application's variables safely. */
+typedef struct _hist_pending {
+  struct _hist_pending *next;
+  char *filename;
+  char *timestamp;	/* NULL if we're not writing one */
+  char *line;
+  int use_fsync;	/* history_append_fsync */
+  int use_index;	/* history_use_index */
+} HIST_PENDING;
+
+#if defined (HISTORY_USE_SHARED)
+/* The shared history ring: a file that every session on the host maps,
+   holding the most recent lines any of them added.  After the header come
+   SIZE bytes of records, used as a ring.  HEAD and TAIL count the bytes
+   ever written, so they only grow: the records still in the ring are the
+   ones from TAIL to HEAD, and the one at position P starts at P % SIZE.
+   A record's text may wrap around the end of the ring.
+
+   Writers hold an fcntl lock on the file while they append.  Readers
+   don't lock it; the ring is a seqlock with TAIL as its sequence.  A
+   writer that needs room moves TAIL past the records it's about to
+   overwrite before it writes, and a reader copies a record out and then
+   checks that TAIL hasn't moved past it in the meantime.  Nothing points
+   into the ring, so it is never a problem that records get overwritten. */
+#define HIST_SHARE_MAGIC	0x48534852	/* "HSHR" */
+#define HIST_SHARE_VERSION	4
+#define HIST_SHARE_DEFAULT	(1024 * 1024)
+#define HIST_SHARE_MINSIZE	4096
+
+typedef struct _hist_share_header {
+  unsigned int magic;
+  int version;
+  int hsize;		/* sizeof (HIST_SHARE_HEADER); rejects other ABIs */
+  unsigned long size;	/* bytes of records */
+  volatile unsigned long head;	/* where the next record goes */
+  volatile unsigned long tail;	/* the oldest record not overwritten */
+} HIST_SHARE_HEADER;
+
+/* Each record is a line and the time from its timestamp, both
+   NUL-terminated, padded so the next record is aligned.  The time is
+   published rather than the timestamp, which begins with the publisher's
+   history_comment_char and looks empty if that is NUL.  Since SIZE is a multiple of the alignment,
+   the record header itself never wraps. */
+typedef struct _hist_share_record {
+  unsigned int len;	/* including this header and the padding */
+  unsigned int pid;	/* the session that added it */
+} HIST_SHARE_RECORD;
+
+#define HIST_SHARE_ALIGN(n)	(((n) + sizeof (unsigned long) - 1) & ~(sizeof (unsigned long) - 1))
+#define HIST_SHARE_DATA(h)	((char *)(h) + HIST_SHARE_ALIGN (sizeof (HIST_SHARE_HEADER)))
+#define HIST_SHARE_MAPSIZE(n)	(HIST_SHARE_ALIGN (sizeof (HIST_SHARE_HEADER)) + (n))
+
+/* Non-zero if ring position A comes before B.  Positions may wrap around
+   on hosts with 32-bit longs. */
+#define HIST_SHARE_BEFORE(a, b)	((long)((a) - (b)) < 0)
+
+/* Readers need the stores to the ring to be seen in the order the writer
+   made them.  Without a way to ask for that, they take the lock too. */
+#if defined (__GNUC__)
+#  define HIST_SHARE_BARRIER()	__sync_synchronize ()
+#  define HIST_SHARE_LOCKFREE	1
+#else
+#  define HIST_SHARE_BARRIER()
+#  define HIST_SHARE_LOCKFREE	0
+#endif
+
+static HIST_SHARE_HEADER *history_share;
+static int history_share_fd = -1;
+static unsigned long history_share_cursor;	/* the next record we'll read */
+static char *history_share_buf;			/* a record copied out */
+static size_t history_share_bufsize;
+#endif /* HISTORY_USE_SHARED */
+
 /* Does S look like the beginning of a history timestamp entry?  Placeholder
    for more extensive tests. */
 #define HIST_TIMESTAMP_START(s)		(*(s) == history_comment_char && isdigit ((unsigned char)(s)[1]) )
@@ -147,6 +306,41 @@ static int histfile_backup PARAMS((const char *, const char *));
 static int histfile_restore PARAMS((const char *, const char *));
 static int history_rename PARAMS((const char *, const char *));
 
+static char *history_indexfile PARAMS((const char *));
+static void history_file_head PARAMS((int, char *));
+static void history_index_free PARAMS((HIST_INDEX *));
+static int history_index_load PARAMS((const char *, HIST_INDEX *));
+static void history_index_save PARAMS((const char *, HIST_INDEX *));
+static unsigned int history_hash_bytes PARAMS((const char *, size_t));
+static unsigned int history_hash_lastline PARAMS((const char *, size_t));
+static unsigned int history_file_tailhash PARAMS((int, off_t));
+static void history_cookie_set PARAMS((HISTORY_COOKIE *, int, struct stat *, off_t));
+static size_t history_resync PARAMS((const char *, size_t, HISTORY_COOKIE *));
+static int history_index_sync PARAMS((int, struct stat *, HIST_INDEX *));
+static void history_index_update PARAMS((const char *));
+static int history_do_read PARAMS((const char *, int, int, HISTORY_COOKIE *));
+static off_t history_tail_offset PARAMS((int, off_t, int, int *, char *));
+static int history_copy_range PARAMS((int, off_t, off_t, int, char *));
+static int history_write_all PARAMS((int, const char *, size_t));
+static int history_buffer_line PARAMS((int, char *, size_t *, const char *, size_t));
+static char *history_write_line PARAMS((int, size_t *, char **, size_t *));
+#if !defined (HISTORY_USE_MMAP)
+static int history_write_entries PARAMS((int, int, int));
+#endif
+static char *history_savetext PARAMS((const char *, size_t));
+static int history_queue_append PARAMS((int, const char *));
+static int history_write_pending PARAMS((HIST_PENDING *));
+static HIST_PENDING *history_take_queue PARAMS((void));
+static void history_free_pending PARAMS((HIST_PENDING *));
+static void history_queue_check_fork PARAMS((void));
+static void history_drain_queue PARAMS((void));
+#if defined (HISTORY_USE_SHARED)
+static int history_share_lock PARAMS((int));
+static int history_share_attach PARAMS((const char *, size_t));
+static void history_share_copy PARAMS((char *, unsigned long, size_t, int));
+static int history_share_read PARAMS((void));
+#endif
+
 /* Return the string that should be used in the place of this
    filename.  This only matters when you don't specify the
    filename to read_history (), or write_history (). */
@@ -252,6 +446,346 @@ history_tempfile (const char *filename)
   return ret;
 }
   
+/* Return the name of the index file for FILENAME, following a symlink
+   so the index lives next to the file it describes. */
+static char *
+history_indexfile (const char *filename)
+{
+  const char *fn;
+  char *ret, linkbuf[PATH_MAX+1];
+  size_t len;
+  ssize_t n;
+
+  fn = filename;
+#if defined (HAVE_READLINK)
+  if ((n = readlink (filename, linkbuf, sizeof (linkbuf) - 1)) > 0)
+    {
+      linkbuf[n] = '\0';
+      fn = linkbuf;
+    }
+#endif
+
+  len = strlen (fn);
+  ret = xmalloc (len + 5);
+  strcpy (ret, fn);
+  strcpy (ret + len, ".idx");
+  return ret;
+}
+
+/* Read the first two characters of the file open on FD into HEAD, which
+   has room for three, so we can check for a leading timestamp. */
+static void
+history_file_head (int fd, char *head)
+{
+  head[0] = head[1] = head[2] = '\0';
+  if (lseek (fd, 0, SEEK_SET) != 0 || read (fd, head, 2) < 0)
+    head[0] = head[1] = '\0';
+}
+
+static void
+history_index_free (HIST_INDEX *idx)
+{
+  FREE (idx->points);
+  idx->points = 0;
+  idx->psize = idx->h.npoints = 0;
+}
+
+/* Read the index in IDXNAME into IDX.  Returns 0 if it's not there or
+   wasn't written by this version of the library. */
+static int
+history_index_load (const char *idxname, HIST_INDEX *idx)
+{
+  int fd;
+  size_t n;
+
+  idx->points = 0;
+  idx->psize = 0;
+  if ((fd = open (idxname, O_RDONLY|O_BINARY, 0666)) < 0)
+    return 0;
+  if (read (fd, &idx->h, sizeof (idx->h)) != sizeof (idx->h) ||
+      idx->h.magic != HISTORY_INDEX_MAGIC ||
+      idx->h.version != HISTORY_INDEX_VERSION ||
+      idx->h.hsize != sizeof (idx->h) ||
+      idx->h.npoints < 0)
+    {
+      close (fd);
+      return 0;
+    }
+  if (idx->h.npoints > 0)
+    {
+      n = idx->h.npoints * sizeof (HIST_INDEX_POINT);
+      idx->points = (HIST_INDEX_POINT *)malloc (n);
+      if (idx->points == 0 || read (fd, idx->points, n) != n)
+	{
+	  history_index_free (idx);
+	  close (fd);
+	  return 0;
+	}
+      idx->psize = idx->h.npoints;
+    }
+  close (fd);
+  return 1;
+}
+
+/* Write IDX to IDXNAME.  The index is only a cache, so errors are
+   ignored. */
+static void
+history_index_save (const char *idxname, HIST_INDEX *idx)
+{
+  char *tempname;
+  size_t n;
+  int fd, rv;
+
+  tempname = history_tempfile (idxname);
+  if ((fd = open (tempname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0600)) < 0)
+    {
+      xfree (tempname);
+      return;
+    }
+  n = idx->h.npoints * sizeof (HIST_INDEX_POINT);
+  rv = write (fd, &idx->h, sizeof (idx->h)) == sizeof (idx->h) &&
+       (n == 0 || write (fd, idx->points, n) == n);
+  if (close (fd) < 0)
+    rv = 0;
+  if (rv == 0 || history_rename (tempname, idxname) < 0)
+    unlink (tempname);
+  xfree (tempname);
+}
+
+/* Hash the N bytes at S (FNV-1a). */
+static unsigned int
+history_hash_bytes (const char *s, size_t n)
+{
+  unsigned int h;
+  size_t i;
+
+  h = 2166136261U;
+  for (i = 0; i < n; i++)
+    {
+      h ^= (unsigned char)s[i];
+      h *= 16777619U;
+    }
+  return h;
+}
+
+/* Hash the last line in the N bytes at S, which end with its newline. */
+static unsigned int
+history_hash_lastline (const char *s, size_t n)
+{
+  size_t i;
+
+  for (i = (n > 0) ? n - 1 : 0; i > 0 && s[i - 1] != '\n'; i--)
+    ;
+  return (history_hash_bytes (s + i, n - i));
+}
+
+/* Hash the HISTORY_INDEX_TAIL bytes of the file open on FD ending at OFF. */
+static unsigned int
+history_file_tailhash (int fd, off_t off)
+{
+  char buf[HISTORY_INDEX_TAIL];
+  off_t start;
+  ssize_t n;
+
+  start = off > HISTORY_INDEX_TAIL ? off - HISTORY_INDEX_TAIL : 0;
+  if (lseek (fd, start, SEEK_SET) != start || (n = read (fd, buf, off - start)) != off - start)
+    return (history_hash_bytes (buf, 0));
+  return (history_hash_bytes (buf, n));
+}
+
+/* Record in SINCE that the file open on FD, which FINFO describes, has
+   been read through OFF. */
+static void
+history_cookie_set (HISTORY_COOKIE *since, int fd, struct stat *finfo, off_t off)
+{
+  char buf[HISTORY_INDEX_TAIL];
+  off_t start;
+  ssize_t n;
+
+  since->dev = finfo->st_dev;
+  since->ino = finfo->st_ino;
+  since->offset = off;
+  start = off > HISTORY_INDEX_TAIL ? off - HISTORY_INDEX_TAIL : 0;
+  if (lseek (fd, start, SEEK_SET) != start || (n = read (fd, buf, off - start)) != off - start)
+    n = 0;
+  since->check = history_hash_bytes (buf, n);
+  since->lastline = history_hash_lastline (buf, n);
+}
+
+/* The file SINCE describes has been replaced or rewritten, and the LEN
+   bytes at BUF are what's in it now.  If they start with the end of what
+   was read before, as they do when history_truncate_file keeps the tail
+   of the file, return the offset just past that, so only the entries
+   appended since are read.  Otherwise return 0 to read it all. */
+static size_t
+history_resync (const char *buf, size_t len, HISTORY_COOKIE *since)
+{
+  register const char *p, *end;
+  size_t off, w;
+
+  if (since->offset == 0)
+    return 0;
+
+  /* The HISTORY_INDEX_TAIL bytes before the old offset have to match,
+     unless less than that was kept, in which case all of it has to end
+     with the last line that was read. */
+  w = since->offset > HISTORY_INDEX_TAIL ? HISTORY_INDEX_TAIL : since->offset;
+  for (p = buf, end = buf + len; p < end && (p = memchr (p, '\n', end - p)); )
+    {
+      off = ++p - buf;
+      if (off >= w)
+	{
+	  if (history_hash_bytes (p - w, w) == since->check)
+	    return off;
+	}
+      else if (history_hash_lastline (buf, off) == since->lastline)
+	return off;
+    }
+  return 0;
+}
+
+/* Bring IDX up to date with the history file open on FD, which FINFO
+   describes.  If IDX describes an earlier version of the same file, count
+   only the lines added since; otherwise start over.  Returns 1 if IDX
+   changed. */
+static int
+history_index_sync (int fd, struct stat *finfo, HIST_INDEX *idx)
+{
+  char buf[8192], head[3], *s, *p, *e;
+  int cc, changed;
+  off_t off, pos;
+  ssize_t n;
+  HIST_INDEX_POINT *pt;
+
+  history_file_head (fd, head);
+  cc = history_comment_char;
+  if (cc == '\0' && head[0] == '#' && isdigit ((unsigned char)head[1]))
+    cc = '#';
+
+  changed = 0;
+  if (idx->h.magic != HISTORY_INDEX_MAGIC || idx->h.comment_char != cc ||
+      idx->h.dev != finfo->st_dev || idx->h.ino != finfo->st_ino ||
+      idx->h.scanned > finfo->st_size ||
+      idx->h.tailhash != history_file_tailhash (fd, idx->h.scanned))
+    {
+      history_index_free (idx);
+      memset (&idx->h, 0, sizeof (idx->h));
+      idx->h.magic = HISTORY_INDEX_MAGIC;
+      idx->h.version = HISTORY_INDEX_VERSION;
+      idx->h.hsize = sizeof (idx->h);
+      idx->h.comment_char = cc;
+      idx->h.dev = finfo->st_dev;
+      idx->h.ino = finfo->st_ino;
+      idx->h.last_ts = (head[0] == cc && isdigit ((unsigned char)head[1])) ? 0 : -1;
+      changed = 1;
+    }
+
+  /* Count each newline once we can see whether the line after it is a
+     timestamp, the same test HIST_TIMESTAMP_START makes.  A newline too
+     close to the end of the file waits until the file grows. */
+  for (off = idx->h.scanned; off < finfo->st_size; )
+    {
+      if (lseek (fd, off, SEEK_SET) != off || (n = read (fd, buf, sizeof (buf))) <= 0)
+	break;
+      e = buf + n;
+      for (s = buf; p = memchr (s, '\n', e - s); s = p + 1)
+	{
+	  if (e - p < 3)
+	    break;
+	  pos = off + (p - buf);
+	  if (p[1] == cc && isdigit ((unsigned char)p[2]))
+	    idx->h.last_ts = pos + 1;
+	  else if (++idx->h.lines % HISTORY_INDEX_STRIDE == 0)
+	    {
+	      if (idx->h.npoints >= idx->psize)
+		{
+		  idx->psize = idx->psize ? idx->psize * 2 : 64;
+		  idx->points = (HIST_INDEX_POINT *)xrealloc (idx->points, idx->psize * sizeof (HIST_INDEX_POINT));
+		}
+	      pt = idx->points + idx->h.npoints++;
+	      pt->nl = pos;
+	      pt->ts = idx->h.last_ts;
+	    }
+	}
+      if (p && off + n >= finfo->st_size)
+	{
+	  off += p - buf;
+	  break;
+	}
+      off += p ? (p - buf) : n;
+    }
+
+  if (off != idx->h.scanned)
+    {
+      idx->h.scanned = off;
+      idx->h.tailhash = history_file_tailhash (fd, off);
+      changed = 1;
+    }
+  return changed;
+}
+
+/* Update the index for the history file FILENAME after writing it. */
+static void
+history_index_update (const char *filename)
+{
+  HIST_INDEX idx;
+  struct stat finfo;
+  char *idxname;
+  int fd;
+
+  if ((fd = open (filename, O_RDONLY|O_BINARY, 0666)) < 0)
+    return;
+  if (fstat (fd, &finfo) == 0 && S_ISREG (finfo.st_mode))
+    {
+      idxname = history_indexfile (filename);
+      if (history_index_load (idxname, &idx) == 0)
+	idx.h.magic = 0;
+      if (history_index_sync (fd, &finfo, &idx))
+	history_index_save (idxname, &idx);
+      history_index_free (&idx);
+      xfree (idxname);
+    }
+  close (fd);
+}
+
+/* Use the index for FILENAME, open on FD, to find the part of the file
+   read_history_range needs to read lines FROM to TO.  Sets *STARTP and
+   *ENDP to the byte offsets to read between.  If we can skip ahead toward
+   FROM, sets *LINEP to the number of the line to resume counting at and
+   *PTP to where it starts. */
+static void
+history_index_range (const char *filename, int fd, struct stat *finfo, int from, int to,
+		     off_t *startp, off_t *endp, HIST_INDEX_POINT *ptp, int *linep)
+{
+  HIST_INDEX idx;
+  char *idxname;
+  int i;
+
+  idxname = history_indexfile (filename);
+  if (history_index_load (idxname, &idx) == 0)
+    idx.h.magic = 0;
+  if (history_index_sync (fd, finfo, &idx))
+    history_index_save (idxname, &idx);
+  xfree (idxname);
+
+  i = from / HISTORY_INDEX_STRIDE;
+  if (i > idx.h.npoints)
+    i = idx.h.npoints;
+  if (i > 0)
+    {
+      *ptp = idx.points[i - 1];
+      *linep = i * HISTORY_INDEX_STRIDE;
+      *startp = (ptp->ts >= 0 && ptp->ts < ptp->nl) ? ptp->ts : ptp->nl;
+    }
+
+  /* Reading through the newline before line TO+1 gets all of line TO. */
+  i = to / HISTORY_INDEX_STRIDE;
+  if (to >= from && i < idx.h.npoints)
+    *endp = idx.points[i].nl + 1;
+
+  history_index_free (&idx);
+}
+
 /* Add the contents of FILENAME to the history list, a line at a time.
    If FILENAME is NULL, then read from ~/.history.  Returns 0 if
    successful, or errno if not. */
@@ -268,12 +802,39 @@ read_history (const char *filename)
    ~/.history.  Returns 0 if successful, or errno if not. */
 int
 read_history_range (const char *filename, int from, int to)
+{
+  return (history_do_read (filename, from, to, (HISTORY_COOKIE *)NULL));
+}
+
+/* Add the entries appended to FILENAME since the last call with COOKIE to
+   the history list.  COOKIE should be zeroed before the first call, which
+   reads the whole file.  If the file has been truncated or replaced since
+   the last call, it's read from the beginning again.  Returns 0 if
+   successful, or errno if not. */
+int
+read_history_since (const char *filename, HISTORY_COOKIE *cookie)
+{
+  return (history_do_read (filename, 0, -1, cookie));
+}
+
+/* Workhorse function for reading history.  Reads lines FROM to TO of
+   FILENAME as described above for read_history_range.  If SINCE is
+   non-null, start reading where it says the last read ended, and update
+   it to say where this one did. */
+static int
+history_do_read (const char *filename, int from, int to, HISTORY_COOKIE *since)
 {
   register char *line_start, *line_end, *p;
-  char *input, *buffer, *bufend, *last_ts;
+  char *input, *buffer, *bufend, *last_ts, *head, headbuf[3];
   int file, current_line, chars_read, has_timestamps, reset_comment_char;
+  int nlines, pending, resume_line, lazy, nlazy, resync;
   struct stat finfo;
   size_t file_size;
+  off_t start, end;
+  HIST_INDEX_POINT resume;
+#ifdef HISTORY_USE_MMAP
+  char *map;
+#endif
 #if defined (EFBIG)
   int overflow_errno = EFBIG;
 #elif defined (EOVERFLOW)
@@ -284,6 +845,7 @@ read_history_range (const char *filename, int from, int to)
 
   history_lines_read_from_file = 0;
 
+  lazy = 0;
   buffer = last_ts = (char *)NULL;
   input = history_filename (filename);
   file = input ? open (input, O_RDONLY|O_BINARY, 0666) : -1;
@@ -310,32 +872,74 @@ read_history_range (const char *filename, int from, int to)
       goto error_and_exit;
     }
 
-  if (file_size == 0)
+  start = 0;
+  end = file_size;
+  resume_line = 0;
+
+  /* Skip what we read last time, unless the file has been replaced,
+     truncated, or rewritten since.  Then we have to look for where the
+     old contents left off. */
+  resync = 0;
+  if (since && since->dev == finfo.st_dev && since->ino == finfo.st_ino &&
+      since->offset <= file_size &&
+      since->check == history_file_tailhash (file, since->offset))
+    start = since->offset;
+  else if (since)
+    resync = 1;
+
+  if (start == file_size)
     {
+      if (since)
+	history_cookie_set (since, file, &finfo, start);
       free (input);
       close (file);
       return 0;	/* don't waste time if we don't have to */
     }
 
+  /* If we're not reading the whole file, use the index to read only the
+     part we need. */
+  if (since == 0 && history_use_index && (from >= HISTORY_INDEX_STRIDE || to >= from))
+    history_index_range (input, file, &finfo, from, to, &start, &end, &resume, &resume_line);
+
 #ifdef HISTORY_USE_MMAP
   /* We map read/write and private so we can change newlines to NULs without
-     affecting the underlying object. */
-  buffer = (char *)mmap (0, file_size, PROT_READ|PROT_WRITE, MAP_RFLAGS, file, 0);
-  if ((void *)buffer == MAP_FAILED)
+     affecting the underlying object.  Pages before START are never
+     touched, so they're never read. */
+  map = (char *)mmap (0, file_size, PROT_READ|PROT_WRITE, MAP_RFLAGS, file, 0);
+  if ((void *)map == MAP_FAILED)
     {
       errno = overflow_errno;
       goto error_and_exit;
     }
-  chars_read = file_size;
+  buffer = map + start;
+  chars_read = end - start;
+
+  /* Reading lazily leaves the entries in the map, so it can't be changed. */
+  lazy = history_lazy_read && from == 0 && to < 0 && since == 0 &&
+	 _hs_history_lazy_begin (map, file_size, 1);
 #else
-  buffer = (char *)malloc (file_size + 1);
+  /* Reading lazily leaves the entries in the buffer, which the backlog
+     frees once they have all been made into entries.  Otherwise, when
+     entries are allocated from an arena, read the file into an arena
+     block so they can use the lines and timestamps where they are. */
+  lazy = history_lazy_read && from == 0 && to < 0 && since == 0 &&
+	 _hs_history_lazy_ok ();
+  if (history_use_arena && lazy == 0)
+    buffer = _hs_history_arena_buffer (end - start + 1);
+  else
+    buffer = (char *)malloc (end - start + 1);
   if (buffer == 0)
     {
       errno = overflow_errno;
       goto error_and_exit;
     }
 
-  chars_read = read (file, buffer, file_size);
+  if (lseek (file, start, SEEK_SET) < 0)
+    chars_read = -1;
+  else
+    chars_read = read (file, buffer, end - start);
+  if (lazy && chars_read >= 0)
+    _hs_history_lazy_begin (buffer, chars_read, 0);
 #endif
   if (chars_read < 0)
     {
@@ -349,109 +953,172 @@ read_history_range (const char *filename, int from, int to)
 
       FREE (input);
 #ifndef HISTORY_USE_MMAP
-      FREE (buffer);
+      if (history_use_arena && lazy == 0)
+	_hs_history_arena_free_buffer (buffer);
+      else
+	FREE (buffer);
 #endif
 
       return (chars_read);
     }
 
-  close (file);
+  /* Look at the start of the file even if we didn't read it. */
+  head = buffer;
+  if (start > 0)
+    history_file_head (file, head = headbuf);
+  if (since == 0)
+    close (file);
 
   /* Set TO to larger than end of file if negative. */
   if (to < 0)
-    to = chars_read;
+    to = resume_line + chars_read + 1;
 
   /* Start at beginning of file, work to end. */
   bufend = buffer + chars_read;
   *bufend = '\0';		/* null-terminate buffer for timestamp checks */
-  current_line = 0;
+  current_line = pending = 0;
 
   /* Heuristic: the history comment character rarely changes, so assume we
      have timestamps if the buffer starts with `#[:digit:]' and temporarily
      set history_comment_char so timestamp parsing works right */
   reset_comment_char = 0;
-  if (history_comment_char == '\0' && buffer[0] == '#' && isdigit ((unsigned char)buffer[1]))
+  if (history_comment_char == '\0' && head[0] == '#' && isdigit ((unsigned char)head[1]))
     {
       history_comment_char = '#';
       reset_comment_char = 1;
     }
 
-  has_timestamps = HIST_TIMESTAMP_START (buffer);
+  has_timestamps = HIST_TIMESTAMP_START (head);
   history_multiline_entries += has_timestamps && history_write_timestamps;
 
+  /* Size the arena so the entries read from the file fit in one block.
+     Unless the file is mapped, the lines stay in the buffer. */
+  if (history_use_arena && lazy == 0)
+    {
+      for (nlines = 1, p = buffer; p = memchr (p, '\n', bufend - p); p++)
+	nlines++;
+#ifdef HISTORY_USE_MMAP
+      _hs_history_arena_reserve (chars_read + 1, nlines);
+#else
+      _hs_history_arena_reserve (0, nlines);
+#endif
+    }
+
   /* Skip lines until we are at FROM. */
-  if (has_timestamps)
+  if (has_timestamps && start == 0)
     last_ts = buffer;
-  for (line_start = line_end = buffer; line_end < bufend && current_line < from; line_end++)
-    if (*line_end == '\n')
-      {
-      	p = line_end + 1;
-      	/* If we see something we think is a timestamp, continue with this
-	   line.  We should check more extensively here... */
-	if (HIST_TIMESTAMP_START(p) == 0)
-	  current_line++;
-	else
-	  last_ts = p;
-	line_start = p;
-	/* If we are at the last line (current_line == from) but we have
-	   timestamps (has_timestamps), then line_start points to the
-	   text of the last command, and we need to skip to its end. */
-	if (current_line >= from && has_timestamps)
-	  {
-	    for (line_end = p; line_end < bufend && *line_end != '\n'; line_end++)
-	      ;
-	    line_start = (*line_end == '\n') ? line_end + 1 : line_end;
-	  }
-      }
+  line_start = line_end = buffer;
+  /* Skip whatever is left of what we read from the file before. */
+  if (resync && (p = buffer + history_resync (buffer, chars_read, since)) > buffer)
+    {
+      line_start = line_end = p;
+      last_ts = (char *)NULL;
+    }
+  /* Pick up counting where the index left off. */
+  if (resume_line > 0)
+    {
+      line_end = buffer + (resume.nl - start);
+      last_ts = (resume.ts >= 0) ? buffer + (resume.ts - start) : (char *)NULL;
+      current_line = resume_line - 1;
+    }
+  /* memchr is usually much faster than looking at a character at a time. */
+  for ( ; current_line < from && line_end < bufend && (line_end = memchr (line_end, '\n', bufend - line_end)); line_end++)
+    {
+      p = line_end + 1;
+      /* If we see something we think is a timestamp, continue with this
+	 line.  We should check more extensively here... */
+      if (HIST_TIMESTAMP_START(p) == 0)
+	current_line++;
+      else
+	last_ts = p;
+      line_start = p;
+      /* If we are at the last line (current_line == from) but we have
+	 timestamps (has_timestamps), then line_start points to the
+	 text of the last command, and we need to skip to its end. */
+      if (current_line >= from && has_timestamps)
+	{
+	  if ((line_end = memchr (p, '\n', bufend - p)) == 0)
+	    line_end = bufend;
+	  line_start = (*line_end == '\n') ? line_end + 1 : line_end;
+	}
+    }
 
   /* If there are lines left to gobble, then gobble them now. */
-  for (line_end = line_start; line_end < bufend; line_end++)
-    if (*line_end == '\n')
-      {
-	/* Change to allow Windows-like \r\n end of line delimiter. */
-	if (line_end > line_start && line_end[-1] == '\r')
-	  line_end[-1] = '\0';
-	else
-	  *line_end = '\0';
-
-	if (*line_start)
-	  {
-	    if (HIST_TIMESTAMP_START(line_start) == 0)
-	      {
-	      	if (last_ts == NULL && history_length > 0 && history_multiline_entries)
-		  _hs_append_history_line (history_length - 1, line_start);
-		else
-		  add_history (line_start);
-		if (last_ts)
-		  {
-		    add_history_time (last_ts);
-		    last_ts = NULL;
-		  }
-	      }
-	    else
-	      {
-		last_ts = line_start;
-		current_line--;
-	      }
-	  }
-
-	current_line++;
+  nlazy = 0;
+  for (line_end = line_start; line_end < bufend && (line_end = memchr (line_end, '\n', bufend - line_end)); line_end++)
+    {
+      /* Change to allow Windows-like \r\n end of line delimiter. */
+      p = (line_end > line_start && line_end[-1] == '\r') ? line_end - 1 : line_end;
+      if (lazy == 0)
+	*p = '\0';
+
+      if (p > line_start && *line_start)
+	{
+	  if (HIST_TIMESTAMP_START(line_start) == 0)
+	    {
+	      if (lazy && last_ts == NULL && nlazy > 0 && history_multiline_entries)
+		_hs_history_lazy_extend (p - buffer);
+	      else if (last_ts == NULL && history_length > 0 && history_multiline_entries)
+		_hs_append_history_line (history_length - 1, line_start);
+	      else if (lazy)
+		{
+		  _hs_history_lazy_add (line_start - buffer, p - line_start,
+					last_ts ? last_ts - buffer : (size_t)-1);
+		  nlazy++;
+		  last_ts = NULL;
+		}
+	      else
+		{
+		  /* The previous entry is complete; check it for duplicates. */
+		  if (pending)
+		    _hs_history_dedup_last (0);
+		  pending = _hs_add_history_line (line_start, p - line_start, last_ts);
+		  last_ts = NULL;
+		}
+	    }
+	  else
+	    {
+	      last_ts = line_start;
+	      current_line--;
+	    }
+	}
+
+      current_line++;
+
+      if (current_line >= to)
+	break;
+
+      line_start = line_end + 1;
+    }
 
-	if (current_line >= to)
-	  break;
+  if (pending)
+    _hs_history_dedup_last (1);
+  if (lazy)
+    _hs_history_lazy_end ();
 
-	line_start = line_end + 1;
-      }
+  /* Next time, start with the first line we didn't use: a timestamp still
+     waiting for its entry or a last line without a newline. */
+  if (since)
+    {
+      history_cookie_set (since, file, &finfo, start + ((last_ts ? last_ts : line_start) - buffer));
+      close (file);
+    }
 
   history_lines_read_from_file = current_line;
   if (reset_comment_char)
     history_comment_char = '\0';
+  if (history_use_arena)
+    _hs_history_arena_reserve (0, 0);
 
   FREE (input);
 #ifndef HISTORY_USE_MMAP
-  FREE (buffer);
+  if (history_use_arena && lazy == 0)
+    _hs_history_arena_free_buffer (buffer);
+  else if (lazy == 0)
+    FREE (buffer);
 #else
-  munmap (buffer, file_size);
+  if (lazy == 0)
+    munmap (map, file_size);
 #endif
 
   return (0);
@@ -513,16 +1180,203 @@ histfile_restore (const char *backup, const char *orig)
 #define SHOULD_CHOWN(finfo, nfinfo) \
   (finfo.st_uid != nfinfo.st_uid || finfo.st_gid != nfinfo.st_gid)
   
+/* Find where the last LINES lines of the file open on FD, which is SIZE
+   bytes long, begin.  A newline ends a line unless the line after it is a
+   timestamp.  Reads the file backwards a block at a time into BUF, which
+   has room for HISTORY_BLOCK_SIZE+2 characters.  Returns the offset,
+   0 if the file doesn't have more than LINES lines, or -1 on a read
+   error.  *LEFTP is set to the number of the LINES lines we didn't find. */
+static off_t
+history_tail_offset (int fd, off_t size, int lines, int *leftp, char *buf)
+{
+  off_t bstart, bend;
+  char la0, la1;
+  ssize_t i, n;
+
+  /* The two characters after each block are the first two of the block
+     we read before it; after the end of the file they're NULs. */
+  buf[0] = buf[1] = '\0';
+  *leftp = lines;
+  for (bend = size; bend > 0; bend = bstart)
+    {
+      bstart = (bend > HISTORY_BLOCK_SIZE) ? bend - HISTORY_BLOCK_SIZE : 0;
+      n = bend - bstart;
+      la0 = buf[0];
+      la1 = buf[1];
+      if (lseek (fd, bstart, SEEK_SET) != bstart || read (fd, buf, n) != n)
+	return -1;
+      buf[n] = la0;
+      buf[n + 1] = la1;
+
+      /* A newline at the start of the file doesn't count. */
+      for (i = n - 1; i >= 0 && bstart + i > 0; i--)
+	if (buf[i] == '\n' && HIST_TIMESTAMP_START (buf + i + 1) == 0)
+	  {
+	    if (*leftp == 0)
+	      return (bstart + i + 1);
+	    (*leftp)--;
+	  }
+    }
+  return 0;
+}
+
+/* Copy LEN bytes starting at offset START in the file open on FROM to
+   the file open on TO, using BUF, which has room for
+   HISTORY_BLOCK_SIZE characters, if the system can't copy them
+   itself.  Returns 0 or errno. */
+static int
+history_copy_range (int from, off_t start, off_t len, int to, char *buf)
+{
+  ssize_t n;
+  int w;
+
+#if defined (HAVE_COPY_FILE_RANGE)
+  off_t off;
+
+  /* Let the kernel copy the data without bringing it into user space.
+     If it can't do that for these files, copy it ourselves. */
+  off = start;
+  n = 0;
+  while (len > 0 && (n = copy_file_range (from, &off, to, NULL, len, 0)) > 0)
+    len -= n;
+  if (len == 0)
+    return 0;
+  if (n < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+    return errno;
+  start = off;
+#endif
+
+  if (lseek (from, start, SEEK_SET) != start)
+    return errno;
+  while (len > 0)
+    {
+      n = read (from, buf, (len > HISTORY_BLOCK_SIZE) ? HISTORY_BLOCK_SIZE : len);
+      if (n <= 0)
+	return (n < 0 ? errno : EIO);
+      if (w = history_write_all (to, buf, n))
+	return w;
+      len -= n;
+    }
+  return 0;
+}
+
+/* Write LEN bytes from BUF to FD, even if it takes more than one write.
+   Returns 0 or errno. */
+static int
+history_write_all (int fd, const char *buf, size_t len)
+{
+  ssize_t n;
+
+  for ( ; len > 0; buf += n, len -= n)
+    if ((n = write (fd, buf, len)) < 0)
+      return errno;
+  return 0;
+}
+
+/* Append the LEN characters of S and a newline to BUFFER, which holds
+   *USEDP characters, writing BUFFER to FD first if they won't fit.
+   Returns 0 or errno. */
+static int
+history_buffer_line (int fd, char *buffer, size_t *usedp, const char *s, size_t len)
+{
+  int rv;
+
+  if (*usedp + len + 1 > HISTORY_BLOCK_SIZE)
+    {
+      if (rv = history_write_all (fd, buffer, *usedp))
+	return rv;
+      *usedp = 0;
+      /* A line too long for the buffer goes straight to the file. */
+      if (len >= HISTORY_BLOCK_SIZE)
+	{
+	  if (rv = history_write_all (fd, s, len))
+	    return rv;
+	  len = 0;
+	}
+    }
+  memcpy (buffer + *usedp, s, len);
+  *usedp += len;
+  buffer[(*usedp)++] = '\n';
+  return 0;
+}
+
+/* Return the text of entry I in the history list, and leave its length in
+   *LENP.  An entry read_history hasn't made yet comes from the backlog,
+   so writing it doesn't make it.  If timestamps are being written and the
+   entry has one, leave it in *TSP and its length in *TSLENP; otherwise
+   *TSP is NULL.  Neither the text of a backlog entry nor any timestamp is
+   NUL-terminated, and backlog text is only good until the next call. */
+static char *
+history_write_line (int i, size_t *lenp, char **tsp, size_t *tslenp)
+{
+  HIST_ENTRY *ent;
+
+  *tsp = (char *)NULL;
+  *tslenp = 0;
+  if (i < _hs_history_lazy_length ())
+    {
+      if (history_write_timestamps && (*tsp = _hs_history_lazy_timestamp (i, tslenp)) && *tslenp == 0)
+	*tsp = (char *)NULL;
+      return (_hs_history_lazy_line (i, lenp));
+    }
+
+  ent = _hs_history_entries ()[i];
+  if (history_write_timestamps && ent->timestamp && ent->timestamp[0])
+    {
+      *tsp = ent->timestamp;
+      *tslenp = strlen (ent->timestamp);
+    }
+  *lenp = _hs_history_line_length (i);
+  return (ent->line);
+}
+
+#if !defined (HISTORY_USE_MMAP)
+/* Write entries FIRST through LAST-1, numbered as history_write_line
+   numbers them, with their timestamps if history_write_timestamps says
+   to, to the file open on FD.  The output goes through a fixed-size
+   buffer, so the memory this needs doesn't depend on the size of the
+   history list.  Returns 0 or errno. */
+static int
+history_write_entries (int fd, int first, int last)
+{
+  char *buffer, *line, *ts;
+  size_t used, len, tslen;
+  int i, rv;
+
+  buffer = (char *)malloc (HISTORY_BLOCK_SIZE);
+  if (buffer == 0)
+    return (errno ? errno : ENOMEM);
+
+  for (rv = 0, used = 0, i = first; rv == 0 && i < last; i++)
+    {
+      line = history_write_line (i, &len, &ts, &tslen);
+      if (ts)
+	rv = history_buffer_line (fd, buffer, &used, ts, tslen);
+      if (rv == 0)
+	rv = history_buffer_line (fd, buffer, &used, line, len);
+    }
+  if (rv == 0 && used > 0)
+    rv = history_write_all (fd, buffer, used);
+
+  xfree (buffer);
+  return rv;
+}
+#endif /* !HISTORY_USE_MMAP */
+
 /* Truncate the history file FNAME, leaving only LINES trailing lines.
    If FNAME is NULL, then use ~/.history.  Writes a new file and renames
    it to the original name.  Returns 0 on success, errno on failure. */
 int
 history_truncate_file (const char *fname, int lines)
 {
-  char *buffer, *filename, *tempname, *bp, *bp1;		/* bp1 == bp+1 */
-  int file, chars_read, rv, orig_lines, exists, r;
+  char *buffer, *filename, *tempname;
+  int file, tfile, rv, orig_lines, exists, r;
   struct stat finfo, nfinfo;
   size_t file_size;
+  off_t start;
+
+  /* Write any queued appends first, so they end up in the right place. */
+  history_drain_queue ();
 
   history_lines_written_to_file = 0;
 
@@ -572,75 +1426,50 @@ history_truncate_file (const char *fname, int lines)
       goto truncate_exit;
     }
 
-  buffer = (char *)malloc (file_size + 1);
-  if (buffer == 0)
+  orig_lines = lines;
+  if (file_size == 0)
     {
-      rv = errno;
       close (file);
       goto truncate_exit;
     }
 
-  chars_read = read (file, buffer, file_size);
-  close (file);
-
-  if (chars_read <= 0)
+  buffer = (char *)malloc (HISTORY_BLOCK_SIZE + 2);
+  if (buffer == 0)
     {
-      rv = (chars_read < 0) ? errno : 0;
+      rv = errno;
+      close (file);
       goto truncate_exit;
     }
 
-  orig_lines = lines;
-  /* Count backwards from the end of buffer until we have passed
-     LINES lines.  bp1 is set funny initially.  But since bp[1] can't
-     be a comment character (since it's off the end) and *bp can't be
-     both a newline and the history comment character, it should be OK. */
-  for (bp1 = bp = buffer + chars_read - 1; lines && bp > buffer; bp--)
-    {
-      if (*bp == '\n' && HIST_TIMESTAMP_START(bp1) == 0)
-	lines--;
-      bp1 = bp;
-    }
-
-  /* If this is the first line, then the file contains exactly the
+  /* Count backwards from the end of the file until we have passed LINES
+     lines, and find the start of the line after the newline before them.
+     If there is no such newline, the file contains no more than the
      number of lines we want to truncate to, so we don't need to do
-     anything.  It's the first line if we don't find a newline between
-     the current value of i and 0.  Otherwise, write from the start of
-     this line until the end of the buffer. */
-  for ( ; bp > buffer; bp--)
-    {
-      if (*bp == '\n' && HIST_TIMESTAMP_START(bp1) == 0)
-        {
-	  bp++;
-	  break;
-        }
-      bp1 = bp;
-    }
-
-  /* Write only if there are more lines in the file than we want to
-     truncate to. */
-  if (bp <= buffer)
+     anything. */
+  start = history_tail_offset (file, file_size, lines, &lines, buffer);
+  if (start <= 0)
     {
-      rv = 0;
-      /* No-op if LINES == 0 at this point */
-      history_lines_written_to_file = orig_lines - lines;
+      rv = (start < 0) ? (errno ? errno : EIO) : 0;
+      close (file);
       goto truncate_exit;
     }
 
   tempname = history_tempfile (filename);
 
-  if ((file = open (tempname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0600)) != -1)
+  /* Copy only the lines we're keeping. */
+  if ((tfile = open (tempname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0600)) != -1)
     {
-      if (write (file, bp, chars_read - (bp - buffer)) < 0)
-	rv = errno;
+      rv = history_copy_range (file, start, file_size - start, tfile, buffer);
 
-      if (fstat (file, &nfinfo) < 0 && rv == 0)
+      if (fstat (tfile, &nfinfo) < 0 && rv == 0)
 	rv = errno;
 
-      if (close (file) < 0 && rv == 0)
+      if (close (tfile) < 0 && rv == 0)
 	rv = errno;
     }
   else
     rv = errno;
+  close (file);
 
  truncate_exit:
   FREE (buffer);
@@ -667,6 +1496,9 @@ history_truncate_file (const char *fname, int lines)
     r = chown (filename, finfo.st_uid, finfo.st_gid);
 #endif
 
+  if (rv == 0 && tempname && history_use_index)
+    history_index_update (filename);
+
   xfree (filename);
   FREE (tempname);
 
@@ -679,7 +1511,6 @@ history_truncate_file (const char *fname, int lines)
 static int
 history_do_write (const char *filename, int nelements, int overwrite)
 {
-  register int i;
   char *output, *tempname, *histname;
   int file, mode, rv, exists;
   struct stat finfo, nfinfo;
@@ -692,6 +1523,10 @@ history_do_write (const char *filename, int nelements, int overwrite)
 #else
   mode = overwrite ? O_WRONLY|O_CREAT|O_TRUNC|O_BINARY : O_WRONLY|O_APPEND|O_BINARY;
 #endif
+
+  /* Write any queued appends first, so they end up in the right place. */
+  history_drain_queue ();
+
   histname = history_filename (filename);
   exists = histname ? (stat (histname, &finfo) == 0) : 0;
 
@@ -716,25 +1551,24 @@ history_do_write (const char *filename, int nelements, int overwrite)
   if (nelements > history_length)
     nelements = history_length;
 
+#ifdef HISTORY_USE_MMAP
   /* Build a buffer of all the lines to write, and write them in one syscall.
      Suggested by Peter Ho (peter@robosts.oxford.ac.uk). */
   {
-    HIST_ENTRY **the_history;	/* local */
-    register int j;
-    int buffer_size;
-    char *buffer;
+    register int i;
+    size_t buffer_size, j, len, tslen;
+    char *buffer, *line, *ts;
 
-    the_history = history_list ();
     /* Calculate the total number of bytes to write. */
     for (buffer_size = 0, i = history_length - nelements; i < history_length; i++)
       {
-	if (history_write_timestamps && the_history[i]->timestamp && the_history[i]->timestamp[0])
-	  buffer_size += strlen (the_history[i]->timestamp) + 1;
-	buffer_size += strlen (the_history[i]->line) + 1;
+	history_write_line (i, &len, &ts, &tslen);
+	if (ts)
+	  buffer_size += tslen + 1;
+	buffer_size += len + 1;
       }
 
     /* Allocate the buffer, and fill it. */
-#ifdef HISTORY_USE_MMAP
     if (ftruncate (file, buffer_size+cursize) == -1)
       goto mmap_error;
     buffer = (char *)mmap (0, buffer_size, PROT_READ|PROT_WRITE, MAP_WFLAGS, file, cursize);
@@ -749,42 +1583,29 @@ mmap_error:
 	FREE (tempname);
 	return rv;
       }
-#else    
-    buffer = (char *)malloc (buffer_size);
-    if (buffer == 0)
-      {
-      	rv = errno;
-	close (file);
-	if (tempname)
-	  unlink (tempname);
-	FREE (histname);
-	FREE (tempname);
-	return rv;
-      }
-#endif
 
     for (j = 0, i = history_length - nelements; i < history_length; i++)
       {
-	if (history_write_timestamps && the_history[i]->timestamp && the_history[i]->timestamp[0])
+	line = history_write_line (i, &len, &ts, &tslen);
+	if (ts)
 	  {
-	    strcpy (buffer + j, the_history[i]->timestamp);
-	    j += strlen (the_history[i]->timestamp);
+	    memcpy (buffer + j, ts, tslen);
+	    j += tslen;
 	    buffer[j++] = '\n';
 	  }
-	strcpy (buffer + j, the_history[i]->line);
-	j += strlen (the_history[i]->line);
+	memcpy (buffer + j, line, len);
+	j += len;
 	buffer[j++] = '\n';
       }
 
-#ifdef HISTORY_USE_MMAP
     if (msync (buffer, buffer_size, MS_ASYNC) != 0 || munmap (buffer, buffer_size) != 0)
       rv = errno;
+  }
 #else
-    if (write (file, buffer, buffer_size) < 0)
-      rv = errno;
-    xfree (buffer);
+  /* Write the lines a buffer at a time rather than building all of the
+     output in memory first. */
+  rv = history_write_entries (file, history_length - nelements, history_length);
 #endif
-  }
 
   history_lines_written_to_file = nelements;
 
@@ -811,17 +1632,393 @@ mmap_error:
     mode = chown (histname, finfo.st_uid, finfo.st_gid);
 #endif
 
+  if (rv == 0 && histname && history_use_index)
+    history_index_update (histname);
+
   FREE (histname);
   FREE (tempname);
 
   return (rv);
 }
 
+/* The queue of entries waiting to be appended to history files.  When
+   compiled with HISTORY_USE_PTHREADS, a worker thread writes them in the
+   background; otherwise they're written by the append_history() call that
+   fills a batch or finds the oldest entry has waited long enough.  Either
+   way, whatever is left is written by history_flush(), which the
+   application has to call before it exits. */
+static HIST_PENDING *pending_head;
+static HIST_PENDING **pending_tail = &pending_head;
+static int pending_count;
+static int pending_error;	/* first write error since history_flush() */
+static pid_t pending_pid;	/* the process that queued the entries */
+
+#if defined (HISTORY_USE_PTHREADS)
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;	/* wakes the worker */
+static pthread_cond_t pending_done = PTHREAD_COND_INITIALIZER;	/* wakes flushers */
+static struct timespec pending_since;	/* when the oldest entry was queued */
+static pthread_t pending_tid;
+static int pending_registered;	/* non-zero once the fork handlers are set */
+static int pending_worker;	/* non-zero once the worker is running */
+static int pending_busy;	/* non-zero while the worker is writing */
+static int pending_flushing;	/* number of threads waiting in a flush */
+static int pending_stopping;	/* non-zero once the worker should exit */
+
+#  define PENDING_LOCK()	pthread_mutex_lock (&pending_lock)
+#  define PENDING_UNLOCK()	pthread_mutex_unlock (&pending_lock)
+#else
+static time_t pending_since;
+
+#  define PENDING_LOCK()
+#  define PENDING_UNLOCK()
+#endif
+
+/* Append the entries in LIST to their files and free them.  Each run of
+   entries for the same file is written with one open and one write per
+   buffer full.  Returns 0 or the first errno. */
+static int
+history_write_pending (HIST_PENDING *list)
+{
+  HIST_PENDING *run, *p;
+  char *buffer;
+  size_t used;
+  int fd, rv, r;
+
+  buffer = (char *)xmalloc (HISTORY_BLOCK_SIZE);
+  for (rv = 0; run = list; )
+    {
+      /* Like history_do_write, append only to a file that's already there. */
+      fd = open (run->filename, O_WRONLY|O_APPEND|O_BINARY, 0600);
+      r = (fd < 0) ? errno : 0;
+      for (used = 0, p = run; p && STREQ (p->filename, run->filename); p = p->next)
+	{
+	  if (r == 0 && p->timestamp)
+	    r = history_buffer_line (fd, buffer, &used, p->timestamp, strlen (p->timestamp));
+	  if (r == 0)
+	    r = history_buffer_line (fd, buffer, &used, p->line, strlen (p->line));
+	}
+      list = p;
+
+      if (fd >= 0)
+	{
+	  if (r == 0 && used > 0)
+	    r = history_write_all (fd, buffer, used);
+#if !defined (_WIN32)
+	  if (r == 0 && run->use_fsync && fsync (fd) < 0)
+	    r = errno;
+#endif
+	  if (close (fd) < 0 && r == 0)
+	    r = errno;
+	  if (r == 0 && run->use_index)
+	    history_index_update (run->filename);
+	}
+      if (rv == 0)
+	rv = r;
+
+      for (p = run; p != list; p = run)
+	{
+	  run = p->next;
+	  xfree (p->filename);
+	  FREE (p->timestamp);
+	  xfree (p->line);
+	  xfree (p);
+	}
+    }
+  xfree (buffer);
+  return rv;
+}
+
+/* Free the entries in LIST without writing them. */
+static void
+history_free_pending (HIST_PENDING *list)
+{
+  HIST_PENDING *p;
+
+  for ( ; p = list; )
+    {
+      list = p->next;
+      xfree (p->filename);
+      FREE (p->timestamp);
+      xfree (p->line);
+      xfree (p);
+    }
+}
+
+/* If this process was forked since the entries were queued, they're the
+   parent's to write, so forget them.  Must be called with the queue
+   locked.  This covers builds without pthread_atfork(). */
+static void
+history_queue_check_fork (void)
+{
+  if (pending_head && pending_pid != getpid ())
+    history_free_pending (history_take_queue ());
+}
+
+/* Take the whole queue.  Must be called with the queue locked. */
+static HIST_PENDING *
+history_take_queue (void)
+{
+  HIST_PENDING *list;
+
+  list = pending_head;
+  pending_head = 0;
+  pending_tail = &pending_head;
+  pending_count = 0;
+  return list;
+}
+
+#if defined (HISTORY_USE_PTHREADS)
+/* The worker thread: wait for a batch to fill, the oldest entry to have
+   waited history_append_latency milliseconds, or a flush, then write
+   everything queued.  Once told to stop, it writes what's left and
+   returns. */
+static void *
+history_append_worker (void *arg)
+{
+  HIST_PENDING *list;
+  struct timespec deadline;
+  int r;
+
+  PENDING_LOCK ();
+  for (;;)
+    {
+      while (pending_head == 0 && pending_stopping == 0)
+	pthread_cond_wait (&pending_cond, &pending_lock);
+      if (pending_head == 0)
+	break;
+
+      deadline = pending_since;
+      deadline.tv_sec += history_append_latency / 1000;
+      deadline.tv_nsec += (history_append_latency % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+	{
+	  deadline.tv_sec++;
+	  deadline.tv_nsec -= 1000000000L;
+	}
+      while (pending_head && pending_count < history_append_batch &&
+	     pending_flushing == 0 && pending_stopping == 0)
+	if (pthread_cond_timedwait (&pending_cond, &pending_lock, &deadline) == ETIMEDOUT)
+	  break;
+      if (pending_head == 0)
+	continue;
+
+      list = history_take_queue ();
+      pending_busy = 1;
+      PENDING_UNLOCK ();
+      r = history_write_pending (list);
+      PENDING_LOCK ();
+      if (r && pending_error == 0)
+	pending_error = r;
+      pending_busy = 0;
+      pthread_cond_broadcast (&pending_done);
+    }
+  PENDING_UNLOCK ();
+  return ((void *)NULL);
+}
+
+/* fork() handlers.  Holding the lock across the fork means the child
+   gets the queue in a consistent state.  The child has no worker, and
+   the parent will write what's queued, so the child starts over with an
+   empty queue. */
+static void
+history_queue_prepare (void)
+{
+  PENDING_LOCK ();
+}
+
+static void
+history_queue_parent (void)
+{
+  PENDING_UNLOCK ();
+}
+
+static void
+history_queue_child (void)
+{
+  pthread_mutex_init (&pending_lock, (pthread_mutexattr_t *)NULL);
+  pthread_cond_init (&pending_cond, (pthread_condattr_t *)NULL);
+  pthread_cond_init (&pending_done, (pthread_condattr_t *)NULL);
+  pending_worker = pending_busy = pending_flushing = pending_stopping = 0;
+  pending_error = 0;
+  history_free_pending (history_take_queue ());
+}
+
+/* Tell the worker thread to finish and wait for it.  The next entry
+   queued starts a new one. */
+static void
+history_queue_stop (void)
+{
+  int worker;
+
+  PENDING_LOCK ();
+  worker = pending_worker;
+  if (worker)
+    {
+      pending_stopping = 1;
+      pthread_cond_signal (&pending_cond);
+    }
+  PENDING_UNLOCK ();
+  if (worker == 0)
+    return;
+  pthread_join (pending_tid, (void **)NULL);
+  PENDING_LOCK ();
+  pending_worker = pending_stopping = 0;
+  PENDING_UNLOCK ();
+}
+#endif
+
+/* Return a copy of the LEN characters at S. */
+static char *
+history_savetext (const char *s, size_t len)
+{
+  char *r;
+
+  r = (char *)xmalloc (len + 1);
+  memcpy (r, s, len);
+  r[len] = '\0';
+  return r;
+}
+
+/* Queue the last NELEMENTS entries in the history list to be appended to
+   FILENAME.  The lines and timestamps are copied, so the history list can
+   change before they're written. */
+static int
+history_queue_append (int nelements, const char *filename)
+{
+  HIST_PENDING *list, **tail, *p;
+  char *histname, *line, *ts;
+  size_t len, tslen;
+  int i, rv;
+
+  history_lines_written_to_file = 0;
+  histname = history_filename (filename);
+  if (histname == 0)
+    return (errno ? errno : ENOENT);
+
+  if (nelements > history_length)
+    nelements = history_length;
+  for (list = 0, tail = &list, i = history_length - nelements; i < history_length; i++)
+    {
+      p = (HIST_PENDING *)xmalloc (sizeof (HIST_PENDING));
+      p->filename = savestring (histname);
+      line = history_write_line (i, &len, &ts, &tslen);
+      p->timestamp = ts ? history_savetext (ts, tslen) : (char *)NULL;
+      p->line = history_savetext (line, len);
+      p->use_fsync = history_append_fsync;
+      p->use_index = history_use_index;
+      *tail = p;
+      tail = &p->next;
+    }
+  *tail = 0;
+  xfree (histname);
+  if (list == 0)
+    return 0;
+
+#if defined (HISTORY_USE_PTHREADS)
+  if (pending_registered == 0)
+    {
+      pthread_atfork (history_queue_prepare, history_queue_parent, history_queue_child);
+      pending_registered = 1;
+    }
+#endif
+
+  /* history_lines_written_to_file stays 0 unless the entries are written
+     before this returns. */
+  rv = -1;
+  PENDING_LOCK ();
+  history_queue_check_fork ();
+  if (pending_head == 0)
+    {
+#if defined (HISTORY_USE_PTHREADS)
+      clock_gettime (CLOCK_REALTIME, &pending_since);
+#else
+      pending_since = time ((time_t *)NULL);
+#endif
+      pending_pid = getpid ();
+    }
+  *pending_tail = list;
+  pending_tail = tail;
+  pending_count += nelements;
+
+#if defined (HISTORY_USE_PTHREADS)
+  if (pending_worker == 0 && pending_stopping == 0 &&
+      pthread_create (&pending_tid, (pthread_attr_t *)NULL, history_append_worker, (void *)NULL) == 0)
+    pending_worker = 1;
+  if (pending_worker)
+    pthread_cond_signal (&pending_cond);
+  else
+    rv = history_write_pending (history_take_queue ());	/* no thread; write now */
+#else
+  /* Without a worker thread, the latency bound can only be checked here. */
+  if (pending_count >= history_append_batch ||
+      difftime (time ((time_t *)NULL), pending_since) * 1000 >= history_append_latency)
+    rv = history_write_pending (history_take_queue ());
+#endif
+  PENDING_UNLOCK ();
+
+  if (rv < 0)
+    return 0;
+  if (rv == 0)
+    history_lines_written_to_file = nelements;
+  return rv;
+}
+
+/* Write everything queued, and wait for the writes in progress to finish.
+   Doesn't reset pending_error. */
+static void
+history_drain_queue (void)
+{
+  int r;
+
+  PENDING_LOCK ();
+#if defined (HISTORY_USE_PTHREADS)
+  if (pending_worker)
+    {
+      pending_flushing++;
+      pthread_cond_signal (&pending_cond);
+      while (pending_head || pending_busy)
+	pthread_cond_wait (&pending_done, &pending_lock);
+      pending_flushing--;
+      PENDING_UNLOCK ();
+      return;
+    }
+#endif
+  history_queue_check_fork ();
+  if (pending_head && (r = history_write_pending (history_take_queue ())) && pending_error == 0)
+    pending_error = r;
+  PENDING_UNLOCK ();
+}
+
+/* Write all the entries append_history() has queued, and wait until they
+   have been written.  If history_async_append has been turned off, the
+   worker thread is stopped too.  Returns 0, or the errno from the first
+   write that failed since the last call. */
+int
+history_flush (void)
+{
+  int r;
+
+  history_drain_queue ();
+#if defined (HISTORY_USE_PTHREADS)
+  if (history_async_append == 0)
+    history_queue_stop ();
+#endif
+  PENDING_LOCK ();
+  r = pending_error;
+  pending_error = 0;
+  PENDING_UNLOCK ();
+  return r;
+}
+
 /* Append NELEMENT entries to FILENAME.  The entries appended are from
    the end of the list minus NELEMENTs up to the end of the list. */
 int
 append_history (int nelements, const char *filename)
 {
+  _hs_history_sweep ();
+  if (history_async_append)
+    return (history_queue_append (nelements, filename));
   return (history_do_write (filename, nelements, HISTORY_APPEND));
 }
 
@@ -831,5 +2028,305 @@ append_history (int nelements, const char *filename)
 int
 write_history (const char *filename)
 {
+  _hs_history_sweep ();
   return (history_do_write (filename, history_length, HISTORY_OVERWRITE));
 }
+
+#if defined (HISTORY_USE_SHARED)
+/* Lock the shared history file for reading or writing, as TYPE says, or
+   unlock it.  Returns 0 or errno. */
+static int
+history_share_lock (int type)
+{
+  struct flock fl;
+
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 1;
+  while (fcntl (history_share_fd, F_SETLKW, &fl) < 0)
+    if (errno != EINTR)
+      return errno;
+  return 0;
+}
+
+/* Map the ring in FILENAME, making one of SIZE bytes if the file is
+   empty, and start using it after the records already in it.  Returns 0
+   or errno. */
+static int
+history_share_attach (const char *filename, size_t size)
+{
+  struct stat finfo;
+  HIST_SHARE_HEADER h;
+  void *map;
+  int fd, rv;
+
+  if ((fd = open (filename, O_RDWR|O_CREAT|O_BINARY, 0600)) < 0)
+    return errno;
+  history_share_fd = fd;
+  if (rv = history_share_lock (F_WRLCK))
+    goto error;
+
+  /* Use the ring that's already there if there is one; otherwise make a
+     new one, but only in an empty file.  Other sessions may have a file
+     with a header we don't recognize mapped, and truncating it under them
+     would get them killed, so that is an error. */
+  if (fstat (fd, &finfo) < 0)
+    {
+      rv = errno;
+      goto error;
+    }
+  if (finfo.st_size == 0)
+    {
+      memset (&h, 0, sizeof (h));
+      h.magic = HIST_SHARE_MAGIC;
+      h.version = HIST_SHARE_VERSION;
+      h.hsize = sizeof (HIST_SHARE_HEADER);
+      h.size = size;
+      if (ftruncate (fd, HIST_SHARE_MAPSIZE (size)) < 0 ||
+	  write (fd, &h, sizeof (h)) != sizeof (h))
+	{
+	  rv = errno ? errno : EIO;
+	  goto error;
+	}
+    }
+  else if (read (fd, &h, sizeof (h)) != sizeof (h) ||
+	   h.magic != HIST_SHARE_MAGIC || h.version != HIST_SHARE_VERSION ||
+	   h.hsize != sizeof (HIST_SHARE_HEADER) || h.size < HIST_SHARE_MINSIZE ||
+	   h.size != HIST_SHARE_ALIGN (h.size) || finfo.st_size < HIST_SHARE_MAPSIZE (h.size))
+    {
+      rv = EINVAL;
+      goto error;
+    }
+
+  map = mmap (0, HIST_SHARE_MAPSIZE (h.size), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      rv = errno;
+      goto error;
+    }
+  history_share = (HIST_SHARE_HEADER *)map;
+  history_share_cursor = history_share->head;
+  history_share_lock (F_UNLCK);
+  return 0;
+
+error:
+  close (fd);
+  history_share_fd = -1;
+  return rv;
+}
+
+/* Copy the N bytes at ring position POS to or from BUF, as TOBUF says,
+   wrapping around the end of the ring. */
+static void
+history_share_copy (char *buf, unsigned long pos, size_t n, int tobuf)
+{
+  char *data;
+  size_t off, k;
+
+  data = HIST_SHARE_DATA (history_share);
+  off = pos % history_share->size;
+  k = history_share->size - off;
+  if (k > n)
+    k = n;
+  if (tobuf)
+    {
+      memcpy (buf, data + off, k);
+      memcpy (buf + k, data, n - k);
+    }
+  else
+    {
+      memcpy (data + off, buf, k);
+      memcpy (data, buf + k, n - k);
+    }
+}
+
+/* Add copies of the records from history_share_cursor on that other
+   sessions added to the history list, and move history_share_cursor past
+   them.  If the ones we hadn't read yet were overwritten, start at the
+   oldest one still there.  Returns the number of lines added. */
+static int
+history_share_read (void)
+{
+  HIST_SHARE_RECORD r;
+  unsigned long head, cursor;
+  char *line, *ts;
+  size_t n;
+  int added, pid;
+
+  pid = getpid ();
+  added = 0;
+  cursor = history_share_cursor;
+  while (1)
+    {
+      head = history_share->head;
+      HIST_SHARE_BARRIER ();
+      if (HIST_SHARE_BEFORE (cursor, history_share->tail))
+	cursor = history_share->tail;
+      if (cursor == head || HIST_SHARE_BEFORE (head, cursor))
+	break;
+
+      history_share_copy ((char *)&r, cursor, sizeof (r), 1);
+      n = r.len - sizeof (r);
+      if (r.len >= sizeof (r) + 2 && r.len <= head - cursor && r.len == HIST_SHARE_ALIGN (r.len))
+	{
+	  if (history_share_bufsize < n)
+	    {
+	      history_share_bufsize = n;
+	      history_share_buf = (char *)xrealloc (history_share_buf, n);
+	    }
+	  history_share_copy (history_share_buf, cursor + sizeof (r), n, 1);
+	}
+
+      /* If a writer started overwriting the record while we copied it,
+	 throw the copy away and go around again. */
+      HIST_SHARE_BARRIER ();
+      if (HIST_SHARE_BEFORE (cursor, history_share->tail))
+	continue;
+      if (r.len < sizeof (r) + 2 || r.len > head - cursor || r.len != HIST_SHARE_ALIGN (r.len))
+	{
+	  cursor = head;		/* corrupt */
+	  break;
+	}
+
+      line = history_share_buf;
+      cursor += r.len;
+      if ((ts = memchr (line, '\0', n)) == 0 || memchr (ts + 1, '\0', n - (ts + 1 - line)) == 0)
+	continue;
+      if (r.pid != pid && _hs_add_history_shared (line, ts + 1))
+	added++;
+    }
+  history_share_cursor = cursor;
+  return added;
+}
+#endif
+
+/* Start sharing history lines with the other sessions using FILENAME, a
+   ring buffer of about SIZE bytes (a default size if SIZE is 0) that is
+   created if the file doesn't exist or is empty.  From now on, add_history()
+   publishes each line in the ring, and history_share_sync() adds the lines
+   the other sessions have published since to the history list.  Returns 0
+   or errno; EINVAL if FILENAME holds something other than a ring, ENOSYS
+   if the library wasn't built with HISTORY_USE_SHARED. */
+int
+history_share_open (const char *filename, size_t size)
+{
+#if defined (HISTORY_USE_SHARED)
+  history_share_close ();
+
+  size = HIST_SHARE_ALIGN (size ? size : HIST_SHARE_DEFAULT);
+  if (size < HIST_SHARE_MINSIZE)
+    size = HIST_SHARE_MINSIZE;
+
+  return (history_share_attach (filename, size));
+#else
+#  if defined (ENOSYS)
+  return ENOSYS;
+#  else
+  return EINVAL;
+#  endif
+#endif
+}
+
+/* Stop sharing history lines with other sessions. */
+void
+history_share_close (void)
+{
+#if defined (HISTORY_USE_SHARED)
+  if (history_share)
+    {
+      munmap ((char *)history_share, HIST_SHARE_MAPSIZE (history_share->size));
+      close (history_share_fd);
+      history_share = (HIST_SHARE_HEADER *)NULL;
+      history_share_fd = -1;
+    }
+  FREE (history_share_buf);
+  history_share_buf = (char *)NULL;
+  history_share_bufsize = 0;
+#endif
+}
+
+/* Publish LINE, added with timestamp TS, to the other sessions sharing
+   history with this one, overwriting the oldest records in the ring if
+   there isn't room for it. */
+void
+_hs_history_share_publish (const char *line, const char *ts)
+{
+#if defined (HISTORY_USE_SHARED)
+  HIST_SHARE_RECORD r, t;
+  unsigned long head, tail;
+  size_t linelen, tslen;
+
+  if (history_share == 0)
+    return;
+
+  /* The time follows the comment character, even when that's a NUL. */
+  if (ts && (ts[0] || history_comment_char == '\0'))
+    ts++;
+  else
+    ts = "";
+  linelen = strlen (line);
+  tslen = strlen (ts);
+  r.len = HIST_SHARE_ALIGN (sizeof (HIST_SHARE_RECORD) + linelen + tslen + 2);
+  r.pid = getpid ();
+  if (r.len > history_share->size || history_share_lock (F_WRLCK))
+    return;
+
+  /* Drop the oldest records until there's room, and tell the readers
+     before overwriting them.  A record that doesn't make sense means the
+     ring is corrupt; start over with an empty one. */
+  head = history_share->head;
+  tail = history_share->tail;
+  if (HIST_SHARE_BEFORE (head, tail) || head - tail > history_share->size)
+    tail = head;
+  while (history_share->size - (head - tail) < r.len)
+    {
+      history_share_copy ((char *)&t, tail, sizeof (t), 1);
+      if (t.len < sizeof (t) + 2 || t.len > head - tail || t.len != HIST_SHARE_ALIGN (t.len))
+	tail = head;
+      else
+	tail += t.len;
+    }
+  if (tail != history_share->tail)
+    {
+      history_share->tail = tail;
+      HIST_SHARE_BARRIER ();
+    }
+
+  history_share_copy ((char *)&r, head, sizeof (r), 0);
+  history_share_copy ((char *)line, head + sizeof (r), linelen + 1, 0);
+  history_share_copy ((char *)ts, head + sizeof (r) + linelen + 1, tslen + 1, 0);
+  HIST_SHARE_BARRIER ();
+
+  /* Skip over our own record if we're up to date. */
+  if (history_share_cursor == head)
+    history_share_cursor = head + r.len;
+  history_share->head = head + r.len;
+
+  history_share_lock (F_UNLCK);
+#endif
+}
+
+/* Add the lines other sessions have published in the shared history ring
+   since the last call to the history list, applying the duplicate policy.
+   If they published more than the ring holds since the last call, the
+   oldest of those lines are lost.  Returns the number of lines added. */
+int
+history_share_sync (void)
+{
+#if defined (HISTORY_USE_SHARED)
+  int n;
+
+  /* Cheap enough to do before every prompt when nothing has changed. */
+  if (history_share == 0 || history_share->head == history_share_cursor)
+    return 0;
+  if (HIST_SHARE_LOCKFREE == 0 && history_share_lock (F_RDLCK))
+    return 0;
+  n = history_share_read ();
+  if (HIST_SHARE_LOCKFREE == 0)
+    history_share_lock (F_UNLCK);
+  return n;
+#else
+  return 0;
+#endif
+}
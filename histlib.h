@@ -77,8 +77,44 @@ extern char *strchr ();
 #define HISTORY_APPEND 0
 #define HISTORY_OVERWRITE 1
 
+/* The bit for the character C in the masks of the characters in a line
+   the library keeps.  Both cases of a letter share a bit; other
+   characters share the rest. */
+#define HISTORY_CHAR_BIT(c) \
+  (1UL << (((unsigned char)(c) >= 'a' && (unsigned char)(c) <= 'z') ? (unsigned char)(c) - 'a' : \
+	   ((unsigned char)(c) >= 'A' && (unsigned char)(c) <= 'Z') ? (unsigned char)(c) - 'A' : \
+	   26 + (unsigned char)(c) % 6))
+
 /* internal extern function declarations used by other parts of the library */
 
+/* history.c */
+extern int _hs_add_history_entry PARAMS((HIST_ENTRY *));
+extern int _hs_add_history_line PARAMS((const char *, size_t, const char *));
+extern int _hs_add_history_shared PARAMS((const char *, const char *));
+extern void _hs_history_dedup_last PARAMS((int));
+extern void _hs_history_arena_reserve PARAMS((size_t, int));
+extern char *_hs_history_arena_buffer PARAMS((size_t));
+extern void _hs_history_arena_free_buffer PARAMS((char *));
+extern size_t _hs_history_line_length PARAMS((int));
+extern size_t _hs_history_line_info PARAMS((int, unsigned long *));
+extern char *_hs_history_get_line PARAMS((int, size_t *));
+extern unsigned long _hs_history_line_chars PARAMS((int));
+extern HIST_ENTRY **_hs_history_entries PARAMS((void));
+extern void _hs_history_sweep PARAMS((void));
+extern void _hs_clear_history_entries PARAMS((void));
+extern int _hs_history_lazy_ok PARAMS((void));
+extern int _hs_history_lazy_begin PARAMS((char *, size_t, int));
+extern void _hs_history_lazy_add PARAMS((size_t, size_t, size_t));
+extern void _hs_history_lazy_extend PARAMS((size_t));
+extern void _hs_history_lazy_end PARAMS((void));
+extern int _hs_history_lazy_length PARAMS((void));
+extern void _hs_history_lazy_load PARAMS((int));
+extern char *_hs_history_lazy_line PARAMS((int, size_t *));
+extern char *_hs_history_lazy_timestamp PARAMS((int, size_t *));
+
+/* histfile.c */
+extern void _hs_history_share_publish PARAMS((const char *, const char *));
+
 /* histsearch.c */
 extern int _hs_history_patsearch PARAMS((const char *, int, int));
 
@@ -50,6 +50,10 @@
 
 #include "xmalloc.h"
 
+#if defined (HISTORY_USE_MMAP)
+#  include <sys/mman.h>
+#endif
+
 #if !defined (errno)
 extern int errno;
 #endif
@@ -62,7 +66,216 @@ extern int errno;
 /* The number of slots to increase the_history by. */
 #define DEFAULT_HISTORY_GROW_SIZE 50
 
+/* Entries read from a history file may be allocated from large blocks of
+   memory instead of one malloc apiece.  Each entry occupies a single piece
+   of its block: the HIST_ENTRY, followed by the line and the timestamp.
+   A block is freed when the last entry allocated from it is freed. */
+typedef struct _hist_arena {
+  size_t size;			/* bytes available for entries */
+  size_t used;			/* bytes handed out so far */
+  int nentries;			/* entries from this block still in use */
+} HIST_ARENA;
+
+#define HIST_ARENA_ALIGN(n)	(((n) + sizeof (char *) - 1) & ~(sizeof (char *) - 1))
+#define HIST_ARENA_HEADER	HIST_ARENA_ALIGN (sizeof (HIST_ARENA))
+#define HIST_ARENA_DATA(a)	((char *)(a) + HIST_ARENA_HEADER)
+#define HIST_ARENA_MINSIZE	65536
+
+/* A line shared by the entries with the same text, when history lines are
+   interned.  The entries' line members point at TEXT.  REFS counts them;
+   the line is freed when the last one is. */
+typedef struct _hist_istr {
+  struct _hist_istr *next;	/* next line in the same bucket */
+  unsigned int hash;
+  int refs;
+  size_t len;
+  char text[1];
+} HIST_ISTR;
+
+#define HIST_ISTR_MINSIZE	256
+
+/* What the library remembers about each entry in the_history.  These live
+   in history_meta, an array parallel to history_array.  ENT is the entry
+   the rest of the information was computed for.  SERIAL increases with
+   each entry added, so the array is sorted by it and an entry can be
+   found again after others have been removed. */
+typedef struct _hist_meta {
+  HIST_ENTRY *ent;
+  unsigned long serial;
+  const char *line;		/* ent->line when HASH, LEN and CHARS were computed */
+  size_t len;			/* strlen (line) */
+  unsigned long chars;		/* HISTORY_CHAR_BIT of each char in line */
+  size_t tslen;			/* strlen (ent->timestamp) */
+  time_t time;			/* history_get_time (ent) */
+  unsigned int hash;		/* hash of line */
+  histdata_t data;		/* ent->data, as far as we know */
+  unsigned long gen;		/* history_generation when ent was added */
+  int flags;
+} HIST_META;
+
+#define HIST_META_DEAD	0x01	/* erased duplicate waiting to be removed */
+
+/* Open-addressed hash tables mapping some property of an entry to its
+   serial number.  A SERIAL of 0 marks an empty slot, and
+   HIST_SLOT_DELETED one whose entry has been removed.  Several entries
+   may share a hash; callers check the entries they find. */
+typedef struct _hist_slot {
+  unsigned int hash;
+  unsigned long serial;
+} HIST_SLOT;
+
+typedef struct _hist_table {
+  HIST_SLOT *slots;
+  size_t size;			/* always a power of two */
+  size_t used;			/* slots not empty, counting deleted */
+} HIST_TABLE;
+
+#define HIST_SLOT_DELETED	((unsigned long)-1)
+#define HIST_TABLE_MINSIZE	64
+
+/* The trigram index used to find the entries that might contain a search
+   string.  Each posting list holds, in increasing order, the serial numbers
+   of the entries whose lines contained the trigram KEY when they were
+   added or changed.  Entries removed since the index was built stay in the
+   lists until it's rebuilt; hist_locate won't find them.  A KEY of 0 marks
+   an empty slot, so keys are stored plus one. */
+typedef struct _hist_posting {
+  unsigned int key;
+  unsigned long *serials;
+  size_t n, size;
+} HIST_POSTING;
+
+#define HIST_TRIGRAM(s) \
+  ((((unsigned int)(unsigned char)(s)[0] << 16) | \
+    ((unsigned int)(unsigned char)(s)[1] << 8) | \
+     (unsigned int)(unsigned char)(s)[2]) + 1)
+#define HIST_TRIGRAM_HASH(k)	((unsigned int)((k) * 2654435761U) >> 8)
+
+/* Hash of a data pointer, for history_data_index. */
+#define HIST_PTR_HASH(p)	((unsigned int)(((unsigned long)(p) >> 3) * 2654435761UL))
+
+/* An entry read from a mapped history file that hasn't been made into a
+   HIST_ENTRY yet.  START and LEN give the text of the entry in the map,
+   which may span several lines if it's a multi-line entry, and TS is the
+   offset of its timestamp line, or HIST_LAZY_NOTS.  TIME is the time in
+   the timestamp, found when the file was read, while history_comment_char
+   was what the file uses. */
+typedef struct _hist_lazy_ent {
+  size_t start;
+  size_t len;
+  size_t ts;
+  time_t time;
+} HIST_LAZY_ENT;
+
+#define HIST_LAZY_NOTS	((size_t)-1)
+
+/* The smallest number of entries to make at once. */
+#define HIST_LAZY_CHUNK	256
+
+/* A history array shared by snapshots and, until it next changes, the
+   history list itself; REFS counts them all, along with a history list
+   still borrowing its entries and a later HIST_SHARED whose PARENT this
+   is.  The list occupies the LENGTH slots starting at ARRAY[START].
+
+   GEN is the history_generation when it was taken.  It owns the entries
+   added after its PARENT was taken, which it frees when it is released;
+   the rest it borrows from PARENT.  GENS holds the generation of each
+   entry once history_meta no longer does, and BORROWED the number
+   borrowed from PARENT. */
+typedef struct _hist_shared {
+  HIST_ENTRY **array;
+  int start;
+  int length;
+  int size;
+  int refs;
+  unsigned long gen;
+  unsigned long *gens;
+  struct _hist_shared *parent;
+  int borrowed;
+} HIST_SHARED;
+
+struct _hist_snapshot {
+  HIST_SHARED *list;
+  int offset;
+  int base;
+  int stifled;
+  int max_entries;
+};
+
+/* Non-zero if the_history[I] is borrowed from history_borrow. */
+#define HIST_BORROWED(i) \
+  (history_borrow && HISTORY_META (i).gen <= history_borrow->gen)
+
+/* Make the history list its own before changing it. */
+#define HIST_UNSHARE() \
+  do { \
+    if (history_shared) \
+      hist_unshare (); \
+  } while (0)
+
+static void hist_format_time PARAMS((char *, size_t));
+static char *hist_savetime PARAMS((const char *));
 static char *hist_inittime PARAMS((void));
+static void history_compact PARAMS((void));
+
+static HIST_ARENA *hist_arena_find PARAMS((const void *));
+static void hist_arena_free_string PARAMS((char *, HIST_ARENA *));
+static void *hist_arena_alloc PARAMS((size_t));
+static void hist_arena_insert PARAMS((HIST_ARENA *));
+static void hist_arena_release PARAMS((HIST_ARENA *));
+static HIST_ENTRY *hist_arena_entry PARAMS((const char *, size_t, const char *));
+static HIST_ENTRY *hist_escape_entry PARAMS((HIST_ENTRY *));
+static char *hist_intern PARAMS((const char *));
+static HIST_ISTR *hist_istr_find PARAMS((const char *));
+static void hist_istr_release PARAMS((HIST_ISTR *));
+static char *hist_line PARAMS((const char *));
+static void hist_free_line PARAMS((char *, HIST_ARENA *));
+
+static time_t hist_parse_time PARAMS((const char *));
+static int hist_times_sorted PARAMS((void));
+static int hist_time_bound PARAMS((time_t, int));
+
+static unsigned int hist_hash PARAMS((const char *, size_t *));
+static unsigned long hist_char_mask PARAMS((const char *));
+static void hist_resize_array PARAMS((int));
+static int hist_meta_sync PARAMS((void));
+static void hist_index_data PARAMS((int, histdata_t));
+static void hist_meta_set PARAMS((int, HIST_ENTRY *, unsigned long));
+static int hist_locate PARAMS((unsigned long));
+static void hist_table_insert PARAMS((HIST_TABLE *, unsigned int, unsigned long));
+static void hist_table_remove PARAMS((HIST_TABLE *, unsigned int, unsigned long));
+static unsigned long hist_table_next PARAMS((HIST_TABLE *, unsigned int, size_t *));
+static void hist_table_free PARAMS((HIST_TABLE *));
+static void hist_meta_unlink PARAMS((int));
+static void hist_set_data PARAMS((int, histdata_t));
+static void hist_dup_rebuild PARAMS((void));
+static int hist_dup_find PARAMS((const char *, unsigned int, size_t, int));
+static int hist_check_dups PARAMS((const char *, int));
+static void hist_sweep_dead PARAMS((void));
+static HIST_POSTING *hist_trigram_find PARAMS((unsigned int, int));
+static void hist_trigram_add PARAMS((unsigned long, const char *));
+static void hist_trigram_build PARAMS((void));
+static void hist_trigram_free PARAMS((void));
+static void hist_trigram_swap PARAMS((HIST_POSTING **, size_t *, size_t *));
+static void hist_trigram_prepend PARAMS((HIST_POSTING *, size_t));
+static size_t hist_posting_bound PARAMS((HIST_POSTING *, unsigned long));
+static int hist_trigram_match PARAMS((HIST_POSTING **, int, unsigned long));
+static int history_insert_entry PARAMS((HIST_ENTRY *));
+static HIST_ENTRY *hist_remove_entry PARAMS((int));
+static void hist_meta_update PARAMS((int));
+static size_t hist_lazy_text PARAMS((HIST_LAZY_ENT *, char *));
+static char *hist_lazy_buffer PARAMS((size_t));
+static HIST_ENTRY *hist_lazy_entry PARAMS((HIST_LAZY_ENT *));
+static int hist_lazy_fill PARAMS((int));
+static void hist_lazy_free PARAMS((void));
+static void hist_lazy_drop PARAMS((int));
+static void hist_lazy_stifle PARAMS((int));
+static void hist_unshare PARAMS((void));
+static void hist_shared_save_gens PARAMS((HIST_SHARED *));
+static void hist_shared_release PARAMS((HIST_SHARED *));
+static void hist_borrow_release PARAMS((void));
+static void hist_own_entry PARAMS((int));
+static void hist_free_slot PARAMS((int));
 
 /* **************************************************************** */
 /*								    */
@@ -73,13 +286,82 @@ static char *hist_inittime PARAMS((void));
 /* An array of HIST_ENTRY.  This is where we store the history. */
 static HIST_ENTRY **the_history = (HIST_ENTRY **)NULL;
 
+/* The block of memory the_history lives in.  When the history is stifled
+   and full, adding an entry slides the_history forward one slot inside
+   this block rather than copying every entry down, and the entries are
+   moved back to the start of the block only when the window reaches the
+   end.  That makes add_history on a full stifled list O(1), amortized. */
+static HIST_ENTRY **history_array = (HIST_ENTRY **)NULL;
+
 /* Non-zero means that we have enforced a limit on the amount of
    history that we save. */
 static int history_stifled;
 
-/* The current number of slots allocated to the input_history. */
+/* The current number of slots allocated to the input_history.  This is
+   the size of history_array, not what's left after the_history. */
 static int history_size;
 
+/* The number of slots in history_array before the_history. */
+#define HISTORY_WINDOW_START()	(the_history - history_array)
+
+/* Per-entry information, parallel to history_array; HISTORY_META(i)
+   describes the_history[i].  This is only kept up to date while
+   history_meta_valid is non-zero; history_set_history_state hands us an
+   array we know nothing about, and we rebuild it when it's next needed. */
+static HIST_META *history_meta = (HIST_META *)NULL;
+static int history_meta_valid = 1;
+static unsigned long history_serial;
+
+/* The sums of the line and timestamp lengths of the entries described by
+   history_meta, kept as entries come and go so history_total_bytes and
+   history_memory_usage don't have to walk the list. */
+static size_t history_line_bytes;
+static size_t history_timestamp_bytes;
+
+/* Non-zero if the times in history_meta might not be in increasing order,
+   so the time range functions can't use binary search until they've
+   checked. */
+static int history_times_unordered;
+
+#define HIST_TIME_ORDER_CHECK(i) \
+  do { \
+    if ((i) > 0 && HISTORY_META ((i) - 1).time > HISTORY_META (i).time) \
+      history_times_unordered = 1; \
+  } while (0)
+
+#define HISTORY_META(i)	(history_meta[HISTORY_WINDOW_START () + (i)])
+
+/* What add_history does with a line that's already in the history list. */
+static int history_dup_policy = HIST_KEEPDUPS;
+
+/* Maps the hash of each line to its entry.  Only built when the duplicate
+   policy needs to search the whole list. */
+static HIST_TABLE history_dup_index;
+
+/* Maps each non-null data pointer to the entries holding it, so readline
+   can find the entries using an undo list without scanning the list. */
+static HIST_TABLE history_data_index;
+
+/* Number of entries marked HIST_META_DEAD. */
+static int history_dead;
+
+/* The trigram index: an open-addressed table of posting lists, built the
+   first time history_search_candidate needs it.  HISTORY_TRIGRAM_STALE
+   counts the entries removed or changed since then. */
+static HIST_POSTING *history_trigrams = (HIST_POSTING *)NULL;
+static size_t history_trigram_size;
+static size_t history_trigram_used;
+static int history_trigram_stale;
+
+/* If non-zero, history_search_candidate keeps a trigram index of the
+   history list and uses it to find the entries that might contain a
+   string. */
+int history_use_trigrams = 0;
+
+/* If non-zero, the lines of entries added to the history list are
+   interned: entries with the same text share one copy of it. */
+int history_intern_lines = 0;
+
 /* If HISTORY_STIFLED is non-zero, then this is the maximum number of
    entries to remember. */
 int history_max_entries;
@@ -95,11 +377,101 @@ int history_length;
 /* The logical `base' of the history array.  It defaults to 1. */
 int history_base = 1;
 
+/* The block we're currently allocating entries from. */
+static HIST_ARENA *history_arenas = (HIST_ARENA *)NULL;
+
+/* All the arena blocks, HISTORY_ARENA_COUNT of them, sorted by the
+   address of their data, so the one holding a pointer can be found with
+   a binary search. */
+static HIST_ARENA **history_arena_list = (HIST_ARENA **)NULL;
+static int history_arena_count;
+static int history_arena_size;
+
+/* If non-zero, the size to make the next arena block. */
+static size_t history_arena_hint;
+
+/* The interned lines: a hash table of HISTORY_ISTR_SIZE chains, holding
+   HISTORY_ISTR_COUNT lines.  HISTORY_ISTR_SAVED is the number of bytes
+   the entries sharing them would otherwise use. */
+static HIST_ISTR **history_istrs = (HIST_ISTR **)NULL;
+static size_t history_istr_size;
+static size_t history_istr_count;
+static size_t history_istr_saved;
+
+/* The entries read_history has found in a history file, mapped or read
+   into memory as HISTORY_LAZY_MAPPED says, but not yet made into
+   HIST_ENTRYs.  They are the first HISTORY_LAZY_COUNT slots of
+   the_history, which hold NULL until they're made; the_history[I] comes
+   from history_lazy_ents[HISTORY_LAZY_FIRST + I].  Their serial numbers
+   were reserved when the file was read, and history_lazy_ents[0] has
+   serial number HISTORY_LAZY_SERIAL.  history_meta has their serial
+   numbers and times, so they can be found without making them, and they
+   are made as the functions that return entries reach them. */
+static char *history_lazy_map;
+static size_t history_lazy_mapsize;
+static int history_lazy_mapped;
+static HIST_LAZY_ENT *history_lazy_ents;
+static int history_lazy_size;
+static int history_lazy_first;
+static int history_lazy_count;
+static unsigned long history_lazy_serial;
+
+/* The timestamp given to backlog entries without one: the time they
+   were read. */
+static char *history_lazy_time;
+
+/* A buffer for _hs_history_lazy_line. */
+static char *history_lazy_buf;
+static size_t history_lazy_bufsize;
+
+/* Make sure the_history[I] has been made, along with the entries after it. */
+#define HIST_LAZY_MAKE(i) \
+  do { \
+    if ((i) < history_lazy_count) \
+      hist_lazy_fill (history_lazy_count - (i)); \
+  } while (0)
+
+/* Remove the entries add_history has marked dead before anything that
+   deals in positions in the list looks at it. */
+#define HIST_SWEEP() \
+  do { \
+    if (history_dead) \
+      hist_sweep_dead (); \
+  } while (0)
+
+/* If non-null, the_history is the list in this shared array, which it
+   may not change until it has been given its own copy. */
+static HIST_SHARED *history_shared;
+
+/* The history list makes its own array when it's changed after a
+   snapshot, but the entries stay where they are: HISTORY_BORROWED of
+   them are still history_borrow's to free, and the list only copies one
+   when it's changed.  An entry is borrowed if it
+   was added no later than history_borrow was taken, which
+   history_generation, advanced by each new snapshot, tells us. */
+static HIST_SHARED *history_borrow;
+static int history_borrowed;
+static unsigned long history_generation = 1;
+
 /* Return the current HISTORY_STATE of the history. */
 HISTORY_STATE *
 history_get_history_state (void)
 {
   HISTORY_STATE *state;
+  register int i;
+
+  /* The state can't describe entries we haven't made yet. */
+  HIST_SWEEP ();
+  hist_lazy_fill (-1);
+
+  /* The caller gets the array itself, and may free the entries in it,
+     so neither can be a snapshot's. */
+  HIST_UNSHARE ();
+  for (i = 0; history_borrow && i < history_length; i++)
+    hist_own_entry (i);
+
+  /* Callers expect ENTRIES to be the start of the allocated array. */
+  history_compact ();
 
   state = (HISTORY_STATE *)xmalloc (sizeof (HISTORY_STATE));
   state->entries = the_history;
@@ -117,7 +489,21 @@ history_get_history_state (void)
 void
 history_set_history_state (HISTORY_STATE *state)
 {
-  the_history = state->entries;
+  if (history_shared)
+    {
+      hist_shared_save_gens (history_shared);
+      hist_shared_release (history_shared);
+      history_shared = (HIST_SHARED *)NULL;
+    }
+  hist_borrow_release ();
+  hist_lazy_free ();
+  history_meta_valid = 0;
+  history_line_bytes = history_timestamp_bytes = 0;
+  hist_table_free (&history_dup_index);
+  hist_table_free (&history_data_index);
+  hist_trigram_free ();
+
+  history_array = the_history = state->entries;
   history_offset = state->offset;
   history_length = state->length;
   history_size = state->size;
@@ -125,26 +511,185 @@ history_set_history_state (HISTORY_STATE *state)
     history_stifled = 1;
 }
 
+/* Return a snapshot of the history list, to be given to
+   history_restore_snapshot later and freed with history_free_snapshot.
+   Taking one doesn't copy anything: the snapshot shares the array and
+   the entries in it, and the history list makes its own copy of the
+   array the first time it's changed afterward.  Entries stay shared
+   until they're removed or changed. */
+HISTORY_SNAPSHOT *
+history_snapshot (void)
+{
+  HISTORY_SNAPSHOT *snap;
+
+  /* A snapshot can't share entries we haven't made yet. */
+  HIST_SWEEP ();
+  hist_lazy_fill (-1);
+
+  if (history_shared == 0)
+    {
+      history_shared = (HIST_SHARED *)xmalloc (sizeof (HIST_SHARED));
+      history_shared->array = history_array;
+      history_shared->start = HISTORY_WINDOW_START ();
+      history_shared->length = history_length;
+      history_shared->size = history_size;
+      history_shared->refs = 1;
+
+      /* Entries added from now on are newer than this snapshot.  It
+	 takes over whatever the list was borrowing. */
+      history_shared->gen = history_generation++;
+      history_shared->gens = (unsigned long *)NULL;
+      history_shared->parent = history_borrow;
+      history_shared->borrowed = history_borrowed;
+      history_borrow = (HIST_SHARED *)NULL;
+      history_borrowed = 0;
+    }
+  history_shared->refs++;
+
+  snap = (HISTORY_SNAPSHOT *)xmalloc (sizeof (HISTORY_SNAPSHOT));
+  snap->list = history_shared;
+  snap->offset = history_offset;
+  snap->base = history_base;
+  snap->stifled = history_stifled;
+  snap->max_entries = history_max_entries;
+  return (snap);
+}
+
+/* Replace the history list with the one saved in SNAP, which is left
+   intact and still has to be freed.  The current list is freed, except
+   for what other snapshots share.  Nothing is copied until the list is
+   next changed. */
+void
+history_restore_snapshot (HISTORY_SNAPSHOT *snap)
+{
+  register int i;
+  HIST_SHARED *sh;
+
+  if (snap == 0)
+    return;
+
+  sh = snap->list;
+  if (sh != history_shared)
+    {
+      hist_lazy_free ();
+      if (history_shared)
+	{
+	  hist_shared_save_gens (history_shared);
+	  hist_shared_release (history_shared);
+	}
+      else
+	{
+	  for (i = 0; i < history_length; i++)
+	    if (HIST_BORROWED (i) == 0)
+	      (void) free_history_entry (the_history[i]);
+	  FREE (history_array);
+	  hist_borrow_release ();
+	}
+
+      sh->refs++;
+      history_shared = sh;
+      history_array = sh->array;
+      the_history = history_array ? history_array + sh->start : (HIST_ENTRY **)NULL;
+      history_length = sh->length;
+      history_size = sh->size;
+
+      /* As with history_set_history_state, what we knew about the old
+	 entries is rebuilt for these when it's next needed. */
+      history_meta_valid = 0;
+      history_line_bytes = history_timestamp_bytes = 0;
+      history_dead = 0;
+      hist_table_free (&history_dup_index);
+      hist_table_free (&history_data_index);
+      hist_trigram_free ();
+    }
+
+  history_offset = snap->offset;
+  history_base = snap->base;
+  history_stifled = snap->stifled;
+  max_input_history = history_max_entries = snap->max_entries;
+}
+
+/* Free SNAP, and whatever of the history it saved nothing else shares. */
+void
+history_free_snapshot (HISTORY_SNAPSHOT *snap)
+{
+  HIST_SHARED *sh;
+
+  if (snap == 0)
+    return;
+
+  sh = snap->list;
+  if (sh == history_shared && sh->refs == 2)
+    {
+      /* The history list is all that's left using the array, so it can
+	 have it back without copying, along with what SH borrowed. */
+      if (sh->parent)
+	hist_meta_sync ();
+      history_borrow = sh->parent;
+      history_borrowed = sh->borrowed;
+      FREE (sh->gens);
+      xfree (sh);
+      history_shared = (HIST_SHARED *)NULL;
+    }
+  else
+    hist_shared_release (sh);
+  xfree (snap);
+}
+
 /* Begin a session in which the history functions might be used.  This
    initializes interactive variables. */
 void
 using_history (void)
 {
+  HIST_SWEEP ();
   history_offset = history_length;
 }
 
-/* Return the number of bytes that the primary history entries are using.
-   This just adds up the lengths of the_history->lines and the associated
-   timestamps. */
+/* Return the number of bytes that the primary history entries are using:
+   the lengths of the_history->lines and the associated timestamps.  This
+   is kept up to date as entries are added, changed, and removed. */
 int
 history_total_bytes (void)
 {
-  register int i, result;
+  if (hist_meta_sync () == 0)
+    return 0;
+  return ((int)(history_line_bytes + history_timestamp_bytes));
+}
+
+/* Fill in USAGE with the memory the history list is using: the lines and
+   timestamps, the entries themselves, and the library's own bookkeeping.
+   This doesn't walk the list, though it does walk the trigram index if
+   there is one.  It doesn't count malloc's overhead. */
+void
+history_memory_usage (HISTORY_USAGE *usage)
+{
+  register size_t k;
+
+  hist_meta_sync ();
+  HIST_SWEEP ();
+
+  /* Entries still in the backlog have their lines and timestamps counted,
+     but no HIST_ENTRYs yet. */
+  usage->entries = history_length;
+  usage->line_bytes = history_line_bytes + usage->entries;
 
-  for (i = result = 0; the_history && the_history[i]; i++)
-    result += HISTENT_BYTES (the_history[i]);
+  /* Interned lines are counted once, however many entries share them. */
+  usage->line_bytes_shared = (history_istr_saved < usage->line_bytes) ? history_istr_saved : usage->line_bytes;
+  usage->line_bytes -= usage->line_bytes_shared;
+  usage->timestamp_bytes = history_timestamp_bytes + usage->entries;
+  usage->entry_bytes = (history_length - history_lazy_count) * sizeof (HIST_ENTRY);
 
-  return (result);
+  usage->list_bytes = history_size * (sizeof (HIST_ENTRY *) + sizeof (HIST_META));
+
+  usage->index_bytes = (history_dup_index.size + history_data_index.size) * sizeof (HIST_SLOT);
+  usage->index_bytes += history_trigram_size * sizeof (HIST_POSTING);
+  for (k = 0; k < history_trigram_size; k++)
+    usage->index_bytes += history_trigrams[k].size * sizeof (unsigned long);
+  usage->index_bytes += history_lazy_size * sizeof (HIST_LAZY_ENT);
+  usage->index_bytes += history_istr_size * sizeof (HIST_ISTR *) + history_istr_count * sizeof (HIST_ISTR);
+
+  usage->total = usage->line_bytes + usage->timestamp_bytes + usage->entry_bytes +
+		 usage->list_bytes + usage->index_bytes;
 }
 
 /* Returns the magic number which says what history element we are
@@ -152,6 +697,7 @@ history_total_bytes (void)
 int
 where_history (void)
 {
+  HIST_SWEEP ();
   return (history_offset);
 }
 
@@ -160,6 +706,7 @@ where_history (void)
 int
 history_set_pos (int pos)
 {
+  HIST_SWEEP ();
   if (pos > history_length || pos < 0 || !the_history)
     return (0);
   history_offset = pos;
@@ -172,6 +719,26 @@ history_set_pos (int pos)
 HIST_ENTRY **
 history_list (void)
 {
+  HIST_SWEEP ();
+  hist_lazy_fill (-1);
+  return (the_history);
+}
+
+/* Remove the entries add_history has marked dead, for the functions
+   elsewhere in the library that use positions in the list. */
+void
+_hs_history_sweep (void)
+{
+  HIST_SWEEP ();
+}
+
+/* Return the_history as it is, without making the entries in the backlog
+   first, for the functions that deal with the backlog themselves.  The
+   first _hs_history_lazy_length () slots are NULL. */
+HIST_ENTRY **
+_hs_history_entries (void)
+{
+  HIST_SWEEP ();
   return (the_history);
 }
 
@@ -180,6 +747,9 @@ history_list (void)
 HIST_ENTRY *
 current_history (void)
 {
+  HIST_SWEEP ();
+  if (history_offset >= 0)
+    HIST_LAZY_MAKE (history_offset);
   return ((history_offset == history_length) || the_history == 0)
 		? (HIST_ENTRY *)NULL
 		: the_history[history_offset];
@@ -191,6 +761,9 @@ current_history (void)
 HIST_ENTRY *
 previous_history (void)
 {
+  HIST_SWEEP ();
+  if (history_offset > 0)
+    HIST_LAZY_MAKE (history_offset - 1);
   return history_offset ? the_history[--history_offset] : (HIST_ENTRY *)NULL;
 }
 
@@ -200,96 +773,1853 @@ previous_history (void)
 HIST_ENTRY *
 next_history (void)
 {
-  return (history_offset == history_length) ? (HIST_ENTRY *)NULL : the_history[++history_offset];
+  HIST_SWEEP ();
+  if (history_offset >= 0 && history_offset < history_length)
+    HIST_LAZY_MAKE (history_offset + 1);
+  return (history_offset == history_length) ? (HIST_ENTRY *)NULL : the_history[++history_offset];
+}
+
+/* Return the history entry which is logically at OFFSET in the history array.
+   OFFSET is relative to history_base. */
+HIST_ENTRY *
+history_get (int offset)
+{
+  int local_index;
+
+  HIST_SWEEP ();
+  local_index = offset - history_base;
+  if (local_index >= 0)
+    HIST_LAZY_MAKE (local_index);
+  return (local_index >= history_length || local_index < 0 || the_history == 0)
+		? (HIST_ENTRY *)NULL
+		: the_history[local_index];
+}
+
+/* Return the text of the history entry at OFFSET, as history_get numbers
+   them, and leave its length in *LENP; NULL if there is no such entry.
+   An entry in the backlog isn't made: its text comes from the history
+   file and is only good until the next call. */
+char *
+_hs_history_get_line (int offset, size_t *lenp)
+{
+  int local_index;
+
+  local_index = offset - history_base;
+  if (local_index < 0 || local_index >= history_length || the_history == 0)
+    return ((char *)NULL);
+  if (local_index < history_lazy_count)
+    return (_hs_history_lazy_line (local_index, lenp));
+  *lenp = _hs_history_line_length (local_index);
+  return (the_history[local_index]->line);
+}
+
+/* Return the mask of HISTORY_CHAR_BITs of the characters in the line of
+   the history entry at OFFSET, as history_get numbers them, which the
+   library keeps along with its length, so a search can pass over lines
+   that lack a character it needs without looking at them.  An entry in
+   the backlog isn't read: every bit is set. */
+unsigned long
+_hs_history_line_chars (int offset)
+{
+  int local_index;
+  HIST_META *m;
+
+  local_index = offset - history_base;
+  if (local_index < history_lazy_count || local_index >= history_length || the_history == 0)
+    return (~0UL);
+  if (history_meta_valid)
+    {
+      m = &HISTORY_META (local_index);
+      if (m->ent == the_history[local_index] && m->line == the_history[local_index]->line)
+	return (m->chars);
+    }
+  return (hist_char_mask (the_history[local_index]->line));
+}
+
+HIST_ENTRY *
+alloc_history_entry (char *string, char *ts)
+{
+  HIST_ENTRY *temp;
+
+  temp = (HIST_ENTRY *)xmalloc (sizeof (HIST_ENTRY));
+
+  temp->line = string ? savestring (string) : string;
+  temp->data = (char *)NULL;
+  temp->timestamp = ts;
+
+  return temp;
+}
+
+/* Return the time in the history timestamp TS, or 0 if it isn't one.
+   When history_comment_char is 0, the time follows the leading NUL. */
+static time_t
+hist_parse_time (const char *ts)
+{
+  time_t t;
+
+  if (ts == 0 || ts[0] != history_comment_char)
+    return 0;
+  errno = 0;
+  t = (time_t) strtol (ts + 1, (char **)NULL, 10);
+  if (errno == ERANGE)
+    return (time_t)0;
+  return t;
+}
+
+time_t
+history_get_time (HIST_ENTRY *hist)
+{
+  return (hist ? hist_parse_time (hist->timestamp) : 0);
+}
+
+/* Return non-zero if the entries' times never decrease, checking the
+   whole list if something has changed that might have broken that. */
+static int
+hist_times_sorted (void)
+{
+  register int i;
+
+  if (history_times_unordered)
+    {
+      for (i = 1; i < history_length; i++)
+	if (HISTORY_META (i - 1).time > HISTORY_META (i).time)
+	  break;
+      history_times_unordered = (i < history_length);
+    }
+  return (history_times_unordered == 0);
+}
+
+/* Return the offset of the first entry whose time is T or later, or, if
+   UPPER is non-zero, later than T; history_length if there isn't one.
+   The times must be sorted. */
+static int
+hist_time_bound (time_t t, int upper)
+{
+  register int lo, hi, mid;
+
+  for (lo = 0, hi = history_length; lo < hi; )
+    {
+      mid = lo + (hi - lo) / 2;
+      if (upper ? (HISTORY_META (mid).time <= t) : (HISTORY_META (mid).time < t))
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
+/* Return the offset of the oldest entry in the history list with a time
+   of T or later, or -1 if there isn't one.  The times are remembered when
+   the entries are added, and found by binary search as long as they're in
+   increasing order, as they are when entries are added as they're typed. */
+int
+history_find_first_after (time_t t)
+{
+  register int i;
+
+  if (hist_meta_sync () == 0)
+    return -1;
+  HIST_SWEEP ();
+  if (hist_times_sorted ())
+    i = hist_time_bound (t, 0);
+  else
+    for (i = 0; i < history_length && HISTORY_META (i).time < t; i++)
+      ;
+  return (i < history_length ? i : -1);
+}
+
+/* Return a NULL-terminated array of the entries in the history list with
+   times from T0 through T1, oldest first, or NULL if there are none.  The
+   entries are not copied; only the array should be freed. */
+HIST_ENTRY **
+history_range_between (time_t t0, time_t t1)
+{
+  HIST_ENTRY **list;
+  register int i, n;
+  int first, last;
+
+  if (t0 > t1)
+    return ((HIST_ENTRY **)NULL);
+  if (hist_meta_sync () == 0)
+    return ((HIST_ENTRY **)NULL);
+  HIST_SWEEP ();
+
+  if (hist_times_sorted ())
+    {
+      first = hist_time_bound (t0, 0);
+      last = hist_time_bound (t1, 1);
+      if (first >= last)
+	return ((HIST_ENTRY **)NULL);
+      HIST_LAZY_MAKE (first);
+      list = (HIST_ENTRY **)xmalloc ((last - first + 1) * sizeof (HIST_ENTRY *));
+      memcpy (list, the_history + first, (last - first) * sizeof (HIST_ENTRY *));
+      list[last - first] = (HIST_ENTRY *)NULL;
+      return (list);
+    }
+
+  for (i = n = 0, first = -1; i < history_length; i++)
+    if (HISTORY_META (i).time >= t0 && HISTORY_META (i).time <= t1)
+      {
+	if (n++ == 0)
+	  first = i;
+      }
+  if (n == 0)
+    return ((HIST_ENTRY **)NULL);
+  HIST_LAZY_MAKE (first);
+  list = (HIST_ENTRY **)xmalloc ((n + 1) * sizeof (HIST_ENTRY *));
+  for (i = n = 0; i < history_length; i++)
+    if (HISTORY_META (i).time >= t0 && HISTORY_META (i).time <= t1)
+      list[n++] = the_history[i];
+  list[n] = (HIST_ENTRY *)NULL;
+  return (list);
+}
+
+/* Put a history timestamp for the current time into TS, which is LEN
+   bytes long, with an `X' where history_comment_char goes.  The caller
+   copies it and then puts history_comment_char in the copy: it may be a
+   NUL, with the time still following it. */
+static void
+hist_format_time (char *ts, size_t len)
+{
+  time_t t;
+
+  t = (time_t) time ((time_t *)0);
+#if defined (HAVE_VSNPRINTF)		/* assume snprintf if vsnprintf exists */
+  snprintf (ts, len - 1, "X%lu", (unsigned long) t);
+#else
+  sprintf (ts, "X%lu", (unsigned long) t);
+#endif
+}
+
+/* Return a copy of the timestamp TS.  One made while history_comment_char
+   was a NUL starts with it, and the time after it is copied too. */
+static char *
+hist_savetime (const char *ts)
+{
+  char *ret;
+
+  if (ts[0] || history_comment_char || ts[1] == '\0')
+    return (savestring (ts));
+  ret = (char *)xmalloc (strlen (ts + 1) + 2);
+  ret[0] = '\0';
+  strcpy (ret + 1, ts + 1);
+  return ret;
+}
+
+static char *
+hist_inittime (void)
+{
+  char ts[64], *ret;
+
+  hist_format_time (ts, sizeof (ts));
+  ret = savestring (ts);
+  ret[0] = history_comment_char;
+
+  return ret;
+}
+
+/* Return the arena block containing P, or NULL if P wasn't allocated
+   from one. */
+static HIST_ARENA *
+hist_arena_find (const void *p)
+{
+  register int lo, hi, mid;
+  HIST_ARENA *a;
+
+  /* Find the last block whose data starts at or before P. */
+  for (lo = 0, hi = history_arena_count; lo < hi; )
+    {
+      mid = lo + (hi - lo) / 2;
+      if (HIST_ARENA_DATA (history_arena_list[mid]) <= (const char *)p)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  if (lo == 0)
+    return ((HIST_ARENA *)NULL);
+  a = history_arena_list[lo - 1];
+  return (((const char *)p < HIST_ARENA_DATA (a) + a->used) ? a : (HIST_ARENA *)NULL);
+}
+
+/* Add A to the sorted list of arena blocks. */
+static void
+hist_arena_insert (HIST_ARENA *a)
+{
+  register int i;
+
+  if (history_arena_count == history_arena_size)
+    {
+      history_arena_size = history_arena_size ? 2 * history_arena_size : 16;
+      history_arena_list = (HIST_ARENA **)xrealloc (history_arena_list, history_arena_size * sizeof (HIST_ARENA *));
+    }
+  for (i = history_arena_count; i > 0 && HIST_ARENA_DATA (history_arena_list[i - 1]) > HIST_ARENA_DATA (a); i--)
+    history_arena_list[i] = history_arena_list[i - 1];
+  history_arena_list[i] = a;
+  history_arena_count++;
+}
+
+/* Return N bytes from the current arena block, starting a new block if
+   there isn't enough room left in it. */
+static void *
+hist_arena_alloc (size_t n)
+{
+  HIST_ARENA *a;
+  size_t size;
+  void *ret;
+
+  n = HIST_ARENA_ALIGN (n);
+  a = history_arenas;
+  if (a == 0 || a->size - a->used < n)
+    {
+      size = history_arena_hint > HIST_ARENA_MINSIZE ? history_arena_hint : HIST_ARENA_MINSIZE;
+      if (size < n)
+	size = n;
+      a = (HIST_ARENA *)xmalloc (HIST_ARENA_HEADER + size);
+      a->size = size;
+      a->used = 0;
+      a->nentries = 0;
+      hist_arena_insert (a);
+      history_arenas = a;
+    }
+
+  ret = HIST_ARENA_DATA (a) + a->used;
+  a->used += n;
+  return ret;
+}
+
+/* One of the entries allocated from A has been freed.  Give the block
+   back once they all have. */
+static void
+hist_arena_release (HIST_ARENA *a)
+{
+  register int i;
+
+  if (--a->nentries > 0)
+    return;
+  for (i = 0; i < history_arena_count; i++)
+    if (history_arena_list[i] == a)
+      {
+	memmove (history_arena_list + i, history_arena_list + i + 1, (history_arena_count - i - 1) * sizeof (HIST_ARENA *));
+	history_arena_count--;
+	break;
+      }
+  if (a == history_arenas)
+    history_arenas = (HIST_ARENA *)NULL;
+  xfree (a);
+}
+
+/* Arrange for the next arena block to be big enough to hold NENTRIES
+   entries whose lines and timestamps total NBYTES.  read_history_range
+   calls this with an estimate before reading a file, and with zeros when
+   it's done. */
+void
+_hs_history_arena_reserve (size_t nbytes, int nentries)
+{
+  /* Leave room for the alignment padding and a timestamp for each entry. */
+  history_arena_hint = nbytes + nentries * (HIST_ARENA_ALIGN (sizeof (HIST_ENTRY)) + sizeof (char *) + 24);
+}
+
+/* Allocate a history entry for the LEN bytes of LINE and the timestamp TS
+   from an arena block.  If TS is NULL, use the current time. */
+static HIST_ENTRY *
+hist_arena_entry (const char *line, size_t len, const char *ts)
+{
+  HIST_ENTRY *temp;
+  HIST_ARENA *la, *ta;
+  char tsbuf[64], *p;
+  size_t n, tslen;
+  int now;
+
+  /* If LINE or TS is already in an arena block, such as the buffer
+     read_history_range read the file into, point at it instead of
+     copying it.  The entry holds a reference on that block. */
+  la = hist_arena_find (line);
+  ta = ts ? hist_arena_find (ts) : 0;
+  if (now = (ts == 0))
+    {
+      hist_format_time (tsbuf, sizeof (tsbuf));
+      ts = tsbuf;
+    }
+  tslen = strlen (ts);
+
+  n = HIST_ARENA_ALIGN (sizeof (HIST_ENTRY));
+  if (la == 0)
+    n += len + 1;
+  if (ta == 0)
+    n += tslen + 1;
+  temp = (HIST_ENTRY *)hist_arena_alloc (n);
+  history_arenas->nentries++;
+
+  p = (char *)temp + HIST_ARENA_ALIGN (sizeof (HIST_ENTRY));
+  if (la)
+    {
+      temp->line = (char *)line;
+      if (la != history_arenas)
+	la->nentries++;
+    }
+  else
+    {
+      temp->line = p;
+      memcpy (p, line, len);
+      p[len] = '\0';
+      p += len + 1;
+    }
+  if (ta)
+    {
+      temp->timestamp = (char *)ts;
+      if (ta != history_arenas)
+	ta->nentries++;
+    }
+  else
+    {
+      temp->timestamp = p;
+      memcpy (p, ts, tslen + 1);
+      if (now)
+	p[0] = history_comment_char;
+    }
+  temp->data = (char *)NULL;
+
+  return temp;
+}
+
+/* S, the line or timestamp of an entry allocated from block A (or not
+   from an arena if A is NULL), is going away.  Free it, or if it lives in
+   another arena block, drop the entry's reference to that block. */
+static void
+hist_arena_free_string (char *s, HIST_ARENA *a)
+{
+  HIST_ARENA *sa;
+
+  if (s == 0)
+    return;
+  sa = history_arena_count ? hist_arena_find (s) : 0;
+  if (sa == 0)
+    free (s);
+  else if (sa != a)
+    hist_arena_release (sa);
+}
+
+/* Return SIZE bytes for read_history_range to read a history file into.
+   The memory is registered as an arena block, so entries can use the
+   lines and timestamps in it where they are.  The caller holds a
+   reference to the block until it calls _hs_history_arena_free_buffer. */
+char *
+_hs_history_arena_buffer (size_t size)
+{
+  HIST_ARENA *a;
+
+  a = (HIST_ARENA *)malloc (HIST_ARENA_HEADER + size);
+  if (a == 0)
+    return ((char *)NULL);
+  a->size = a->used = size;
+  a->nentries = 1;
+  hist_arena_insert (a);
+  return (HIST_ARENA_DATA (a));
+}
+
+void
+_hs_history_arena_free_buffer (char *buffer)
+{
+  HIST_ARENA *a;
+
+  if (buffer && (a = hist_arena_find (buffer)))
+    hist_arena_release (a);
+}
+
+/* Return the interned copy of S, making one if there isn't one yet.  The
+   caller holds a reference to it. */
+static char *
+hist_intern (const char *s)
+{
+  HIST_ISTR **old, *ip, *next;
+  unsigned int hash;
+  size_t len, k, oldsize;
+
+  hash = hist_hash (s, &len);
+  if (history_istrs)
+    for (ip = history_istrs[hash & (history_istr_size - 1)]; ip; ip = ip->next)
+      if (ip->hash == hash && ip->len == len && memcmp (ip->text, s, len) == 0)
+	{
+	  ip->refs++;
+	  history_istr_saved += len + 1;
+	  return (ip->text);
+	}
+
+  if (history_istr_count >= history_istr_size)
+    {
+      old = history_istrs;
+      oldsize = history_istr_size;
+      history_istr_size = oldsize ? 2 * oldsize : HIST_ISTR_MINSIZE;
+      history_istrs = (HIST_ISTR **)xmalloc (history_istr_size * sizeof (HIST_ISTR *));
+      memset (history_istrs, 0, history_istr_size * sizeof (HIST_ISTR *));
+      for (k = 0; k < oldsize; k++)
+	for (ip = old[k]; ip; ip = next)
+	  {
+	    next = ip->next;
+	    ip->next = history_istrs[ip->hash & (history_istr_size - 1)];
+	    history_istrs[ip->hash & (history_istr_size - 1)] = ip;
+	  }
+      FREE (old);
+    }
+
+  ip = (HIST_ISTR *)xmalloc (sizeof (HIST_ISTR) + len);
+  ip->hash = hash;
+  ip->refs = 1;
+  ip->len = len;
+  memcpy (ip->text, s, len + 1);
+  ip->next = history_istrs[hash & (history_istr_size - 1)];
+  history_istrs[hash & (history_istr_size - 1)] = ip;
+  history_istr_count++;
+  return (ip->text);
+}
+
+/* Return the interned line whose text is at P, or NULL if P isn't one.
+   Callers check history_istrs first, so nothing is hashed when no lines
+   are interned. */
+static HIST_ISTR *
+hist_istr_find (const char *p)
+{
+  HIST_ISTR *ip;
+  unsigned int hash;
+
+  if (history_istrs == 0 || p == 0)
+    return ((HIST_ISTR *)NULL);
+  hash = hist_hash (p, (size_t *)NULL);
+  for (ip = history_istrs[hash & (history_istr_size - 1)]; ip; ip = ip->next)
+    if (ip->text == p)
+      return ip;
+  return ((HIST_ISTR *)NULL);
+}
+
+/* Drop a reference to IP, freeing it if it was the last. */
+static void
+hist_istr_release (HIST_ISTR *ip)
+{
+  HIST_ISTR **pp;
+
+  if (--ip->refs > 0)
+    {
+      history_istr_saved -= ip->len + 1;
+      return;
+    }
+  for (pp = &history_istrs[ip->hash & (history_istr_size - 1)]; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+  xfree (ip);
+  if (--history_istr_count == 0)
+    {
+      xfree (history_istrs);
+      history_istrs = (HIST_ISTR **)NULL;
+      history_istr_size = 0;
+    }
+}
+
+/* Return a line with the text of S for a new entry in the history list:
+   an interned one if history_intern_lines is set, else a copy. */
+static char *
+hist_line (const char *s)
+{
+  return (history_intern_lines ? hist_intern (s) : savestring (s));
+}
+
+/* Free LINE, the line of an entry allocated from arena block A, if any,
+   whether it's interned, in an arena, or allocated on its own. */
+static void
+hist_free_line (char *line, HIST_ARENA *a)
+{
+  HIST_ISTR *ip;
+
+  if (history_istrs && (ip = hist_istr_find (line)))
+    hist_istr_release (ip);
+  else
+    hist_arena_free_string (line, a);
+}
+
+/* HIST is about to be handed back to the caller, who is entitled to free
+   its members directly.  hist_own_entry has already made sure the list
+   owns it, not a snapshot.  If it came from an arena block, return a copy
+   allocated the usual way and release the original; if its line is
+   interned, give it its own copy. */
+static HIST_ENTRY *
+hist_escape_entry (HIST_ENTRY *hist)
+{
+  HIST_ENTRY *ret;
+  HIST_ISTR *ip;
+
+  if (hist == 0)
+    return hist;
+
+  if (history_arena_count && hist_arena_find (hist))
+    {
+      ret = copy_history_entry (hist);
+      free_history_entry (hist);
+      return ret;
+    }
+
+  if (history_istrs && (ip = hist_istr_find (hist->line)))
+    {
+      hist->line = savestring (ip->text);
+      hist_istr_release (ip);
+    }
+  return hist;
+}
+
+/* Copy the text of E, as read_history would have built it, to BUF, which
+   must have room for E->len + 1 characters: the lines of a multi-line
+   entry are joined with newlines, without carriage returns or empty lines.
+   Returns the length of the text.  If BUF is NULL, just measure it. */
+static size_t
+hist_lazy_text (HIST_LAZY_ENT *e, char *buf)
+{
+  register char *s, *end, *nl;
+  size_t n, len;
+
+  len = 0;
+  for (s = history_lazy_map + e->start, end = s + e->len; s < end; s = nl + 1)
+    {
+      if ((nl = memchr (s, '\n', end - s)) == 0)
+	nl = end;
+      n = nl - s;
+      if (nl < end && n > 0 && nl[-1] == '\r')
+	n--;
+      if (n > 0 && *s)
+	{
+	  if (len > 0)
+	    {
+	      if (buf)
+		buf[len] = '\n';
+	      len++;
+	    }
+	  if (buf)
+	    memcpy (buf + len, s, n);
+	  len += n;
+	}
+    }
+  if (buf)
+    buf[len] = '\0';
+  return len;
+}
+
+/* Return history_lazy_buf, making it at least SIZE bytes long first. */
+static char *
+hist_lazy_buffer (size_t size)
+{
+  if (history_lazy_bufsize < size)
+    {
+      history_lazy_bufsize = size;
+      history_lazy_buf = (char *)xrealloc (history_lazy_buf, history_lazy_bufsize);
+    }
+  return (history_lazy_buf);
+}
+
+/* Leave a pointer to E's timestamp, as read_history would have saved it,
+   in *SP and return its length.  The timestamp isn't NUL-terminated. */
+static size_t
+hist_lazy_ts (HIST_LAZY_ENT *e, char **sp)
+{
+  char *s, *nl;
+  size_t n;
+
+  if (e->ts == HIST_LAZY_NOTS)
+    {
+      *sp = history_lazy_time;
+      return (strlen (history_lazy_time));
+    }
+  s = history_lazy_map + e->ts;
+  n = history_lazy_mapsize - e->ts;
+  if (nl = memchr (s, '\n', n))
+    n = (nl > s && nl[-1] == '\r') ? nl - s - 1 : nl - s;
+  *sp = s;
+  return n;
+}
+
+/* Make a HIST_ENTRY for E. */
+static HIST_ENTRY *
+hist_lazy_entry (HIST_LAZY_ENT *e)
+{
+  HIST_ENTRY *ent;
+  char *s;
+  size_t n;
+
+  ent = (HIST_ENTRY *)xmalloc (sizeof (HIST_ENTRY));
+  if (history_intern_lines)
+    {
+      hist_lazy_text (e, hist_lazy_buffer (e->len + 1));
+      ent->line = hist_intern (history_lazy_buf);
+    }
+  else
+    {
+      ent->line = (char *)xmalloc (e->len + 1);
+      hist_lazy_text (e, ent->line);
+    }
+  ent->data = (histdata_t)NULL;
+
+  /* history_lazy_time may begin with a NUL comment character, with the
+     time after it, so it's copied whole. */
+  if (e->ts == HIST_LAZY_NOTS)
+    {
+      n = strlen (history_lazy_time + 1) + 1;
+      ent->timestamp = (char *)xmalloc (n + 1);
+      memcpy (ent->timestamp, history_lazy_time, n + 1);
+      return ent;
+    }
+  n = hist_lazy_ts (e, &s);
+  ent->timestamp = (char *)xmalloc (n + 1);
+  memcpy (ent->timestamp, s, n);
+  ent->timestamp[n] = '\0';
+  return ent;
+}
+
+/* Make HIST_ENTRYs for at least WANT of the newest entries in the
+   backlog, or for all of them if WANT is negative, putting them in their
+   slots in the_history.  Returns the number made.  Each call makes at
+   least as many as have been made already, so walking back through the
+   whole backlog rebuilds the trigram index's posting lists only a
+   logarithmic number of times. */
+static int
+hist_lazy_fill (int want)
+{
+  register int i, k;
+  HIST_LAZY_ENT *e;
+  HIST_POSTING *older;
+  size_t oldersize, olderused;
+
+  if (history_lazy_count == 0)
+    return 0;
+  HIST_UNSHARE ();
+
+  k = (want > HIST_LAZY_CHUNK) ? want : HIST_LAZY_CHUNK;
+  if (k < history_length - history_lazy_count)
+    k = history_length - history_lazy_count;
+  if (want < 0 || k > history_lazy_count)
+    k = history_lazy_count;
+
+  /* These entries have older serial numbers than anything in the trigram
+     index, so adding them one at a time would insert at the front of
+     every posting list.  Set the index aside while they're made, index
+     them on their own, and put their postings in front all at once. */
+  older = (HIST_POSTING *)NULL;
+  oldersize = olderused = 0;
+  if (history_trigrams)
+    hist_trigram_swap (&older, &oldersize, &olderused);
+
+  history_lazy_count -= k;
+  e = history_lazy_ents + history_lazy_first + history_lazy_count;
+  for (i = history_lazy_count; i < history_lazy_count + k; i++, e++)
+    {
+      the_history[i] = hist_lazy_entry (e);
+      if (history_meta_valid)
+	{
+	  history_line_bytes -= HISTORY_META (i).len;
+	  history_timestamp_bytes -= HISTORY_META (i).tslen;
+	  hist_meta_set (i, the_history[i], history_lazy_serial + (e - history_lazy_ents));
+	  HISTORY_META (i).time = e->time;
+	}
+    }
+
+  if (older)
+    {
+      if (history_meta_valid)
+	for (i = history_lazy_count; i < history_lazy_count + k; i++)
+	  hist_trigram_add (HISTORY_META (i).serial, the_history[i]->line);
+      hist_trigram_swap (&older, &oldersize, &olderused);
+      hist_trigram_prepend (older, oldersize);
+    }
+
+  if (history_lazy_count == 0)
+    hist_lazy_free ();
+  return k;
+}
+
+/* Forget the N oldest entries in the backlog, whose slots have been taken
+   out of the_history. */
+static void
+hist_lazy_drop (int n)
+{
+  register int i;
+
+  for (i = 0; history_meta_valid && i < n; i++)
+    {
+      history_line_bytes -= HISTORY_META (i).len;
+      history_timestamp_bytes -= HISTORY_META (i).tslen;
+    }
+  history_lazy_first += n;
+  if ((history_lazy_count -= n) == 0)
+    hist_lazy_free ();
+}
+
+/* Drop the oldest entries in the backlog until there are no more than MAX
+   entries altogether, or the backlog is empty, sliding the_history past
+   their slots. */
+static void
+hist_lazy_stifle (int max)
+{
+  int n;
+
+  if (history_lazy_count == 0 || history_length <= max)
+    return;
+  n = history_length - max;
+  if (n > history_lazy_count)
+    n = history_lazy_count;
+  hist_lazy_drop (n);
+  the_history += n;
+  history_length -= n;
+  history_base += n;
+}
+
+/* Forget the backlog and unmap or free the file contents it came from. */
+static void
+hist_lazy_free (void)
+{
+#if defined (HISTORY_USE_MMAP)
+  if (history_lazy_map && history_lazy_mapped)
+    munmap (history_lazy_map, history_lazy_mapsize);
+  else
+#endif
+  FREE (history_lazy_map);
+  history_lazy_map = (char *)NULL;
+  history_lazy_mapsize = 0;
+  FREE (history_lazy_ents);
+  history_lazy_ents = (HIST_LAZY_ENT *)NULL;
+  history_lazy_size = history_lazy_first = history_lazy_count = 0;
+  FREE (history_lazy_buf);
+  history_lazy_buf = (char *)NULL;
+  history_lazy_bufsize = 0;
+  FREE (history_lazy_time);
+  history_lazy_time = (char *)NULL;
+}
+
+/* Return non-zero if a history file can be read without making HIST_ENTRYs
+   for its entries: the history list has to be empty, and the duplicate
+   policy can't need to compare the entries. */
+int
+_hs_history_lazy_ok (void)
+{
+  return (history_length == 0 && history_lazy_map == 0 && history_dup_policy == HIST_KEEPDUPS);
+}
+
+/* Start reading the entries in the SIZE bytes of a history file at MAP
+   without making HIST_ENTRYs for them.  MAP is the file mapped into
+   memory if MAPPED is non-zero, and a malloc'd copy of it otherwise.
+   Returns non-zero if that's possible, as _hs_history_lazy_ok says; if it
+   is, the backlog owns MAP. */
+int
+_hs_history_lazy_begin (char *map, size_t size, int mapped)
+{
+  if (_hs_history_lazy_ok () == 0)
+    return 0;
+  hist_meta_sync ();
+  history_lazy_map = map;
+  history_lazy_mapsize = size;
+  history_lazy_mapped = mapped;
+  history_lazy_first = history_lazy_count = 0;
+  return 1;
+}
+
+/* Add the entry whose text is the LEN bytes at offset START of the map to
+   the backlog.  TS is the offset of its timestamp line, or (size_t)-1. */
+void
+_hs_history_lazy_add (size_t start, size_t len, size_t ts)
+{
+  HIST_LAZY_ENT *e;
+
+  if (history_lazy_count == history_lazy_size)
+    {
+      history_lazy_size = history_lazy_size ? 2 * history_lazy_size : HIST_LAZY_CHUNK;
+      history_lazy_ents = (HIST_LAZY_ENT *)xrealloc (history_lazy_ents, history_lazy_size * sizeof (HIST_LAZY_ENT));
+    }
+  e = &history_lazy_ents[history_lazy_count++];
+  e->start = start;
+  e->len = len;
+  e->ts = ts;
+}
+
+/* Extend the last entry added to the backlog through offset END, to add
+   another line to a multi-line entry. */
+void
+_hs_history_lazy_extend (size_t end)
+{
+  HIST_LAZY_ENT *e;
+
+  e = &history_lazy_ents[history_lazy_count - 1];
+  e->len = end - e->start;
+}
+
+/* Finish reading the backlog.  The entries get their serial numbers and
+   their slots in the_history now, as if they'd been added, and the newest
+   of them are made into HIST_ENTRYs. */
+void
+_hs_history_lazy_end (void)
+{
+  register int i;
+  int n;
+  time_t now;
+  char *ts;
+  HIST_LAZY_ENT *e;
+
+  n = history_lazy_count;
+  if (n > 0)
+    {
+      history_lazy_serial = history_serial + 1;
+      history_serial += n;
+      if (history_stifled && n > history_max_entries)
+	{
+	  history_lazy_first = n - history_max_entries;
+	  history_lazy_count = history_max_entries;
+	}
+    }
+  if (history_lazy_count == 0)
+    {
+      hist_lazy_free ();
+      return;
+    }
+
+  HIST_UNSHARE ();
+  history_compact ();
+  if (history_size < history_lazy_count + 2)
+    hist_resize_array (history_lazy_count + DEFAULT_HISTORY_GROW_SIZE);
+
+  /* The entries' times are needed to find entries by time without
+     making them first, and the timestamps can't be parsed later if
+     read_history changed history_comment_char to read them. */
+  history_lazy_time = hist_inittime ();
+  now = hist_parse_time (history_lazy_time);
+  for (i = 0, e = history_lazy_ents + history_lazy_first; i < history_lazy_count; i++, e++)
+    {
+      e->time = (e->ts == HIST_LAZY_NOTS) ? now : hist_parse_time (history_lazy_map + e->ts);
+      the_history[i] = (HIST_ENTRY *)NULL;
+      if (history_meta_valid)
+	{
+	  hist_meta_set (i, (HIST_ENTRY *)NULL, history_lazy_serial + (e - history_lazy_ents));
+	  HISTORY_META (i).time = e->time;
+	  HIST_TIME_ORDER_CHECK (i);
+	  /* Count the line and timestamp now, as history_total_bytes
+	     would if the entry had been made. */
+	  HISTORY_META (i).len = hist_lazy_text (e, (char *)NULL);
+	  HISTORY_META (i).tslen = hist_lazy_ts (e, &ts);
+	  history_line_bytes += HISTORY_META (i).len;
+	  history_timestamp_bytes += HISTORY_META (i).tslen;
+	}
+    }
+  the_history[history_lazy_count] = (HIST_ENTRY *)NULL;
+  history_length = history_lazy_count;
+
+  hist_lazy_fill (0);
+}
+
+/* Return the number of slots at the start of the_history whose entries
+   are still in the backlog. */
+int
+_hs_history_lazy_length (void)
+{
+  return (history_lazy_count);
+}
+
+/* Make the_history[I] into a HIST_ENTRY if it's still in the backlog,
+   along with the entries after it. */
+void
+_hs_history_lazy_load (int i)
+{
+  HIST_LAZY_MAKE (i);
+}
+
+/* Return the text of the_history[I], which is still in the backlog, and
+   leave its length in *LENP; NULL if it isn't in the backlog.  The text
+   is only good until the next call. */
+char *
+_hs_history_lazy_line (int i, size_t *lenp)
+{
+  HIST_LAZY_ENT *e;
+
+  if (i < 0 || i >= history_lazy_count)
+    return ((char *)NULL);
+  e = &history_lazy_ents[history_lazy_first + i];
+  *lenp = hist_lazy_text (e, hist_lazy_buffer (e->len + 1));
+  return (history_lazy_buf);
+}
+
+/* Return the timestamp of the_history[I], which is still in the backlog,
+   and leave its length in *LENP; NULL if it isn't in the backlog.  The
+   timestamp isn't NUL-terminated. */
+char *
+_hs_history_lazy_timestamp (int i, size_t *lenp)
+{
+  char *s;
+
+  if (i < 0 || i >= history_lazy_count)
+    return ((char *)NULL);
+  *lenp = hist_lazy_ts (&history_lazy_ents[history_lazy_first + i], &s);
+  return s;
+}
+
+/* Move the entries in the_history, including the trailing NULL, back to
+   the start of history_array. */
+static void
+history_compact (void)
+{
+  if (the_history == 0 || the_history == history_array)
+    return;
+  HIST_UNSHARE ();
+  if (history_meta_valid)
+    memmove (history_meta, &HISTORY_META (0), history_length * sizeof (HIST_META));
+  memmove (history_array, the_history, (history_length + 1) * sizeof (HIST_ENTRY *));
+  the_history = history_array;
+}
+
+/* Make history_array, and history_meta along with it, SIZE slots long.
+   The window must already be at the start of the array. */
+static void
+hist_resize_array (int size)
+{
+  HIST_UNSHARE ();
+  history_size = size;
+  history_array = (HIST_ENTRY **)xrealloc (history_array, history_size * sizeof (HIST_ENTRY *));
+  the_history = history_array;
+  if (history_meta_valid)
+    history_meta = (HIST_META *)xrealloc (history_meta, history_size * sizeof (HIST_META));
+}
+
+/* Give the history list its own copy of the array it shares with one or
+   more snapshots, before changing it.  Only the pointers are copied, to
+   the same slots, so history_meta still describes them; the entries are
+   borrowed from the shared array, and the list's reference to it is now
+   held for them. */
+static void
+hist_unshare (void)
+{
+  HIST_SHARED *sh;
+  HIST_ENTRY **array;
+  int start;
+
+  sh = history_shared;
+  hist_meta_sync ();		/* HIST_BORROWED needs the generations */
+  hist_shared_save_gens (sh);
+
+  array = (HIST_ENTRY **)NULL;
+  if (history_array)
+    {
+      start = HISTORY_WINDOW_START ();
+      array = (HIST_ENTRY **)xmalloc (history_size * sizeof (HIST_ENTRY *));
+      memcpy (array + start, the_history, (history_length + 1) * sizeof (HIST_ENTRY *));
+      the_history = array + start;
+    }
+  history_array = array;
+  history_shared = (HIST_SHARED *)NULL;
+
+  history_borrow = sh;
+  history_borrowed = history_length;
+  if (history_borrowed == 0)
+    hist_borrow_release ();
+}
+
+/* The history list is about to stop using SH.  If SH borrows some of
+   its entries, save the generation of each, which only history_meta
+   knows, so SH can tell which of them are its own to free. */
+static void
+hist_shared_save_gens (HIST_SHARED *sh)
+{
+  register int i;
+
+  if (sh->parent == 0 || sh->gens || sh->length == 0 || history_meta_valid == 0)
+    return;
+  sh->gens = (unsigned long *)xmalloc (sh->length * sizeof (unsigned long));
+  for (i = 0; i < sh->length; i++)
+    sh->gens[i] = HISTORY_META (i).gen;
+}
+
+/* Let go of SH.  If this was the last reference, free it along with its
+   array and the entries it owns, and let go of its parent. */
+static void
+hist_shared_release (HIST_SHARED *sh)
+{
+  register int i;
+
+  if (--sh->refs > 0)
+    return;
+  for (i = 0; i < sh->length; i++)
+    if (sh->parent == 0 || (sh->gens && sh->gens[i] > sh->parent->gen))
+      (void) free_history_entry (sh->array[sh->start + i]);
+  if (sh->parent)
+    hist_shared_release (sh->parent);
+  FREE (sh->gens);
+  FREE (sh->array);
+  xfree (sh);
+}
+
+/* Stop borrowing entries from a snapshot's array. */
+static void
+hist_borrow_release (void)
+{
+  if (history_borrow)
+    hist_shared_release (history_borrow);
+  history_borrow = (HIST_SHARED *)NULL;
+  history_borrowed = 0;
+}
+
+/* the_history[I] is about to be changed in place, or handed to the
+   caller.  If it's borrowed from a snapshot, put a copy in its place
+   first.  The data goes with the copy: it belongs to the application
+   using the history list, which may free it, so the snapshot's entry
+   mustn't keep a pointer to it. */
+static void
+hist_own_entry (int i)
+{
+  HIST_ENTRY *old;
+
+  HIST_UNSHARE ();
+  if (HIST_BORROWED (i) == 0)
+    return;
+  old = the_history[i];
+  the_history[i] = copy_history_entry (old);
+  old->data = (histdata_t)NULL;
+  hist_meta_update (i);
+  HISTORY_META (i).gen = history_generation;
+  if (--history_borrowed == 0)
+    hist_borrow_release ();
+}
+
+/* the_history[I] is being removed from the list.  Free it, unless it's
+   borrowed from a snapshot, which will free it itself. */
+static void
+hist_free_slot (int i)
+{
+  HIST_UNSHARE ();
+  if (HIST_BORROWED (i) == 0)
+    (void) free_history_entry (the_history[i]);
+  else if (--history_borrowed == 0)
+    hist_borrow_release ();
+}
+
+/* A simple string hash (FNV-1a).  If LENP is non-null, the length of S
+   is left there. */
+static unsigned int
+hist_hash (const char *s, size_t *lenp)
+{
+  register unsigned int h;
+  register const char *p;
+
+  for (h = 2166136261U, p = s; *p; p++)
+    h = (h ^ (unsigned char)*p) * 16777619U;
+  if (lenp)
+    *lenp = p - s;
+  return h;
+}
+
+/* Return the mask of HISTORY_CHAR_BITs of the characters in S. */
+static unsigned long
+hist_char_mask (const char *s)
+{
+  register unsigned long mask;
+
+  for (mask = 0; *s; s++)
+    mask |= HISTORY_CHAR_BIT (*s);
+  return mask;
+}
+
+/* Record that the_history[I] is ENT, added with serial number SERIAL. */
+static void
+hist_meta_set (int i, HIST_ENTRY *ent, unsigned long serial)
+{
+  HIST_META *m;
+
+  m = &HISTORY_META (i);
+  m->ent = ent;
+  m->serial = serial;
+  m->line = ent ? ent->line : 0;
+  m->len = 0;
+  m->hash = m->line ? hist_hash (m->line, &m->len) : 0;
+  m->chars = m->line ? hist_char_mask (m->line) : 0;
+  m->tslen = (ent && ent->timestamp) ? strlen (ent->timestamp) : 0;
+  m->time = ent ? hist_parse_time (ent->timestamp) : 0;
+  history_line_bytes += m->len;
+  history_timestamp_bytes += m->tslen;
+  m->data = ent ? ent->data : 0;
+  m->gen = history_generation;
+  m->flags = 0;
+  if (history_dup_index.slots)
+    hist_table_insert (&history_dup_index, m->hash, m->serial);
+  if (m->data)
+    hist_table_insert (&history_data_index, HIST_PTR_HASH (m->data), m->serial);
+  if (history_trigrams && ent && ent->line)
+    hist_trigram_add (m->serial, ent->line);
+}
+
+/* Remove the_history[I] from the tables that refer to it, before it is
+   removed from the list or changed. */
+static void
+hist_meta_unlink (int i)
+{
+  HIST_META *m;
+
+  if (history_meta_valid == 0)
+    return;
+  m = &HISTORY_META (i);
+  if ((m->flags & HIST_META_DEAD) == 0)
+    {
+      history_line_bytes -= m->len;
+      history_timestamp_bytes -= m->tslen;
+    }
+  if (history_dup_index.slots)
+    hist_table_remove (&history_dup_index, m->hash, m->serial);
+  if (m->data)
+    hist_table_remove (&history_data_index, HIST_PTR_HASH (m->data), m->serial);
+  if (history_trigrams)
+    history_trigram_stale++;
+}
+
+/* Set the data of the_history[I] to DATA. */
+static void
+hist_set_data (int i, histdata_t data)
+{
+  hist_own_entry (i);
+  the_history[i]->data = data;
+  hist_index_data (i, data);
+}
+
+/* Record in the data index that the_history[I] holds DATA. */
+static void
+hist_index_data (int i, histdata_t data)
+{
+  HIST_META *m;
+
+  if (history_meta_valid == 0)
+    return;
+  m = &HISTORY_META (i);
+  if (m->data)
+    hist_table_remove (&history_data_index, HIST_PTR_HASH (m->data), m->serial);
+  m->data = data;
+  if (data)
+    hist_table_insert (&history_data_index, HIST_PTR_HASH (data), m->serial);
+}
+
+/* Make sure history_meta describes the_history, rebuilding it if we
+   were handed a history list by history_set_history_state.  Returns
+   non-zero if there is anything in it. */
+static int
+hist_meta_sync (void)
+{
+  register int i;
+
+  if (history_meta_valid == 0)
+    {
+      history_meta = (HIST_META *)xrealloc (history_meta, (history_size > 0 ? history_size : 1) * sizeof (HIST_META));
+      history_meta_valid = 1;
+      history_line_bytes = history_timestamp_bytes = 0;
+      history_times_unordered = 1;
+      for (i = 0; i < history_length; i++)
+	{
+	  hist_meta_set (i, the_history[i], ++history_serial);
+	  /* A list restored from a snapshot is that snapshot's entries. */
+	  if (history_shared)
+	    HISTORY_META (i).gen = history_shared->gens ? history_shared->gens[i] : history_shared->gen;
+	}
+    }
+  return (the_history != 0 && history_length > 0);
+}
+
+/* Return the length of the line in the_history[I].  This is remembered
+   when the entry is added or changed through the library, so the search
+   and write functions don't have to measure each line; a line the
+   application has replaced behind our back is measured again. */
+size_t
+_hs_history_line_length (int i)
+{
+  HIST_META *m;
+
+  if (history_meta_valid)
+    {
+      m = &HISTORY_META (i);
+      if (m->ent == the_history[i] && m->line == the_history[i]->line)
+	return (m->len);
+    }
+  return (strlen (the_history[i]->line));
+}
+
+/* Return the length of the line in the_history[I], and leave the mask of
+   HISTORY_CHAR_BITs of its characters in *CHARSP.  If we don't know them
+   without looking at the line, every bit is set. */
+size_t
+_hs_history_line_info (int i, unsigned long *charsp)
+{
+  HIST_META *m;
+
+  if (history_meta_valid)
+    {
+      m = &HISTORY_META (i);
+      if (m->ent == the_history[i] && m->line == the_history[i]->line)
+	{
+	  *charsp = m->chars;
+	  return (m->len);
+	}
+    }
+  *charsp = ~0UL;
+  return (strlen (the_history[i]->line));
+}
+
+/* the_history[WHICH] has been replaced or its line changed; recompute
+   what we know about it. */
+static void
+hist_meta_update (int which)
+{
+  unsigned long gen;
+
+  if (history_meta_valid == 0)
+    return;
+  gen = HISTORY_META (which).gen;
+  hist_meta_unlink (which);
+  hist_meta_set (which, the_history[which], HISTORY_META (which).serial);
+  HISTORY_META (which).gen = gen;
+  HIST_TIME_ORDER_CHECK (which);
+  if (which + 1 < history_length)
+    HIST_TIME_ORDER_CHECK (which + 1);
+}
+
+/* Return the index of the entry with serial number SERIAL, or -1 if it's
+   no longer in the history list. */
+static int
+hist_locate (unsigned long serial)
+{
+  register int lo, hi, mid;
+
+  lo = 0;
+  hi = history_length - 1;
+  while (lo <= hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (HISTORY_META (mid).serial == serial)
+	return mid;
+      else if (HISTORY_META (mid).serial < serial)
+	lo = mid + 1;
+      else
+	hi = mid - 1;
+    }
+  return -1;
+}
+
+/* Add an entry with serial number SERIAL and hash HASH to table T,
+   growing it first if it would be more than half full. */
+static void
+hist_table_insert (HIST_TABLE *t, unsigned int hash, unsigned long serial)
+{
+  register size_t k, mask;
+  HIST_SLOT *old;
+  size_t oldsize, live;
+
+  if ((t->used + 1) * 2 > t->size)
+    {
+      /* Rehash the live slots, dropping the deleted ones. */
+      old = t->slots;
+      oldsize = t->size;
+      for (k = live = 0; k < oldsize; k++)
+	if (old[k].serial != 0 && old[k].serial != HIST_SLOT_DELETED)
+	  live++;
+      for (t->size = HIST_TABLE_MINSIZE; t->size < 4 * (live + 1); t->size <<= 1)
+	;
+      t->slots = (HIST_SLOT *)xmalloc (t->size * sizeof (HIST_SLOT));
+      memset (t->slots, 0, t->size * sizeof (HIST_SLOT));
+      t->used = 0;
+      for (k = 0; k < oldsize; k++)
+	if (old[k].serial != 0 && old[k].serial != HIST_SLOT_DELETED)
+	  hist_table_insert (t, old[k].hash, old[k].serial);
+      FREE (old);
+    }
+
+  mask = t->size - 1;
+  for (k = hash & mask; t->slots[k].serial != 0 && t->slots[k].serial != HIST_SLOT_DELETED; k = (k + 1) & mask)
+    ;
+  if (t->slots[k].serial == 0)
+    t->used++;
+  t->slots[k].hash = hash;
+  t->slots[k].serial = serial;
+}
+
+/* Remove the entry with serial number SERIAL and hash HASH from T. */
+static void
+hist_table_remove (HIST_TABLE *t, unsigned int hash, unsigned long serial)
+{
+  register size_t k, mask;
+
+  if (t->slots == 0)
+    return;
+  mask = t->size - 1;
+  for (k = hash & mask; t->slots[k].serial != 0; k = (k + 1) & mask)
+    if (t->slots[k].serial == serial)
+      {
+	t->slots[k].serial = HIST_SLOT_DELETED;
+	return;
+      }
+}
+
+/* Return the serial number of the next entry in T with hash HASH, or 0
+   if there are no more.  *KP holds the position between calls, and
+   should be (size_t)-1 to start. */
+static unsigned long
+hist_table_next (HIST_TABLE *t, unsigned int hash, size_t *kp)
+{
+  register size_t k, mask;
+
+  if (t->slots == 0)
+    return 0;
+  mask = t->size - 1;
+  for (k = (*kp == (size_t)-1) ? (hash & mask) : ((*kp + 1) & mask); t->slots[k].serial != 0; k = (k + 1) & mask)
+    if (t->slots[k].serial != HIST_SLOT_DELETED && t->slots[k].hash == hash)
+      {
+	*kp = k;
+	return (t->slots[k].serial);
+      }
+  return 0;
+}
+
+static void
+hist_table_free (HIST_TABLE *t)
+{
+  FREE (t->slots);
+  t->slots = (HIST_SLOT *)NULL;
+  t->size = t->used = 0;
+}
+
+/* Build the duplicate table from the entries in the list. */
+static void
+hist_dup_rebuild (void)
+{
+  register int i;
+
+  hist_table_free (&history_dup_index);
+  for (i = 0; i < history_length; i++)
+    if ((HISTORY_META (i).flags & HIST_META_DEAD) == 0)
+      hist_table_insert (&history_dup_index, HISTORY_META (i).hash, HISTORY_META (i).serial);
+}
+
+/* Return the index of an entry before LIMIT whose line is LINE, which
+   hashes to HASH and is LEN bytes long, or -1 if there isn't one. */
+static int
+hist_dup_find (const char *line, unsigned int hash, size_t len, int limit)
+{
+  unsigned long serial;
+  size_t k;
+  register int i;
+
+  if (history_dup_index.slots == 0)
+    hist_dup_rebuild ();
+
+  k = (size_t)-1;
+  while (serial = hist_table_next (&history_dup_index, hash, &k))
+    {
+      i = hist_locate (serial);
+      if (i >= 0 && i < limit && the_history[i]->line &&
+	  _hs_history_line_length (i) == len && STREQ (the_history[i]->line, line))
+	return i;
+    }
+  return -1;
+}
+
+/* Apply the duplicate policy to LINE, which is about to become (or just
+   became) entry LIMIT.  Returns non-zero if LINE should not be kept.  For
+   HIST_ERASEDUPS, earlier copies are just marked dead, so hist_sweep_dead
+   can remove them all at once rather than moving the entries after each
+   one. */
+static int
+hist_check_dups (const char *line, int limit)
+{
+  unsigned int hash;
+  size_t len;
+  int i;
+
+  if (line == 0 || history_dup_policy == HIST_KEEPDUPS || hist_meta_sync () == 0)
+    return 0;
+
+  if (history_dup_policy == HIST_IGNOREDUPS)
+    return (limit > 0 && the_history[limit - 1]->line && STREQ (the_history[limit - 1]->line, line));
+
+  hash = hist_hash (line, &len);
+  if (history_dup_policy == HIST_IGNOREALLDUPS)
+    return (hist_dup_find (line, hash, len, limit) >= 0);
+
+  while ((i = hist_dup_find (line, hash, len, limit)) >= 0)
+    {
+      hist_meta_unlink (i);
+      HISTORY_META (i).flags |= HIST_META_DEAD;
+      history_dead++;
+    }
+  return 0;
+}
+
+/* Remove the entries hist_check_dups marked dead in one pass. */
+static void
+hist_sweep_dead (void)
+{
+  register int i, j;
+
+  HIST_UNSHARE ();
+  for (i = j = 0; i < history_length; i++)
+    {
+      if (HISTORY_META (i).flags & HIST_META_DEAD)
+	hist_free_slot (i);
+      else
+	{
+	  the_history[j] = the_history[i];
+	  HISTORY_META (j) = HISTORY_META (i);
+	  j++;
+	}
+    }
+  the_history[j] = (HIST_ENTRY *)NULL;
+  history_length = j;
+  history_dead = 0;
+}
+
+/* Set the duplicate policy add_history uses to POLICY, and return the
+   previous one. */
+int
+history_set_dup_policy (int policy)
+{
+  int old;
+
+  HIST_SWEEP ();
+  old = history_dup_policy;
+  history_dup_policy = policy;
+  if (policy != HIST_IGNOREALLDUPS && policy != HIST_ERASEDUPS)
+    hist_table_free (&history_dup_index);
+  else
+    hist_lazy_fill (-1);	/* these look through the whole list */
+  return (old);
+}
+
+/* Apply the duplicate policy to the most recent entry, which was added
+   by _hs_add_history_line without it.  read_history_range calls this once
+   each entry is complete, since multi-line entries are built after they
+   are added.  If FINISH is non-zero, this is the last entry read, and any
+   earlier copies are removed now. */
+void
+_hs_history_dedup_last (int finish)
+{
+  if (history_length > 0 && hist_check_dups (the_history[history_length - 1]->line, history_length - 1))
+    {
+      hist_free_slot (history_length - 1);
+      (void) hist_remove_entry (history_length - 1);
+    }
+  if (finish && history_dead)
+    hist_sweep_dead ();
+}
+
+/* Return the posting list for trigram KEY, or NULL if there isn't one.
+   If CREATE is non-zero, make an empty one instead. */
+static HIST_POSTING *
+hist_trigram_find (unsigned int key, int create)
+{
+  register size_t k, mask;
+  HIST_POSTING *old;
+  size_t oldsize;
+
+  if (create && (history_trigram_used + 1) * 2 > history_trigram_size)
+    {
+      old = history_trigrams;
+      oldsize = history_trigram_size;
+      history_trigram_size = oldsize ? oldsize * 2 : 1024;
+      history_trigrams = (HIST_POSTING *)xmalloc (history_trigram_size * sizeof (HIST_POSTING));
+      memset (history_trigrams, 0, history_trigram_size * sizeof (HIST_POSTING));
+      mask = history_trigram_size - 1;
+      for (k = 0; k < oldsize; k++)
+	if (old[k].key)
+	  {
+	    register size_t j;
+
+	    for (j = HIST_TRIGRAM_HASH (old[k].key) & mask; history_trigrams[j].key; j = (j + 1) & mask)
+	      ;
+	    history_trigrams[j] = old[k];
+	  }
+      FREE (old);
+    }
+
+  if (history_trigrams == 0)
+    return ((HIST_POSTING *)NULL);
+  mask = history_trigram_size - 1;
+  for (k = HIST_TRIGRAM_HASH (key) & mask; history_trigrams[k].key; k = (k + 1) & mask)
+    if (history_trigrams[k].key == key)
+      return (&history_trigrams[k]);
+  if (create == 0)
+    return ((HIST_POSTING *)NULL);
+  history_trigrams[k].key = key;
+  history_trigram_used++;
+  return (&history_trigrams[k]);
+}
+
+/* Return the position of the first serial number in P's list that is
+   not less than SERIAL. */
+static size_t
+hist_posting_bound (HIST_POSTING *p, unsigned long serial)
+{
+  size_t lo, hi, mid;
+
+  lo = 0;
+  hi = p->n;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (p->serials[mid] < serial)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
+/* Add SERIAL to the posting list of each trigram in LINE.  New entries
+   have the largest serial number, so this is usually an append; an entry
+   whose line changed is put in its place. */
+static void
+hist_trigram_add (unsigned long serial, const char *line)
+{
+  HIST_POSTING *p;
+  size_t k;
+
+  for (; line[0] && line[1] && line[2]; line++)
+    {
+      p = hist_trigram_find (HIST_TRIGRAM (line), 1);
+      if (p->n > 0 && p->serials[p->n - 1] >= serial)
+	{
+	  k = hist_posting_bound (p, serial);
+	  if (k < p->n && p->serials[k] == serial)
+	    continue;
+	}
+      else
+	k = p->n;
+      if (p->n == p->size)
+	{
+	  p->size = p->size ? p->size * 2 : 4;
+	  p->serials = (unsigned long *)xrealloc (p->serials, p->size * sizeof (unsigned long));
+	}
+      if (k < p->n)
+	memmove (p->serials + k + 1, p->serials + k, (p->n - k) * sizeof (unsigned long));
+      p->serials[k] = serial;
+      p->n++;
+    }
 }
 
-/* Return the history entry which is logically at OFFSET in the history array.
-   OFFSET is relative to history_base. */
-HIST_ENTRY *
-history_get (int offset)
+/* Return non-zero if SERIAL is in all N of the posting lists in LISTS
+   after the first, which it was taken from. */
+static int
+hist_trigram_match (HIST_POSTING **lists, int n, unsigned long serial)
 {
-  int local_index;
+  register int j;
+  size_t k;
 
-  local_index = offset - history_base;
-  return (local_index >= history_length || local_index < 0 || the_history == 0)
-		? (HIST_ENTRY *)NULL
-		: the_history[local_index];
+  for (j = 1; j < n; j++)
+    {
+      k = hist_posting_bound (lists[j], serial);
+      if (k == lists[j]->n || lists[j]->serials[k] != serial)
+	return 0;
+    }
+  return 1;
 }
 
-HIST_ENTRY *
-alloc_history_entry (char *string, char *ts)
+static void
+hist_trigram_free (void)
 {
-  HIST_ENTRY *temp;
+  register size_t k;
+
+  for (k = 0; k < history_trigram_size; k++)
+    FREE (history_trigrams[k].serials);
+  FREE (history_trigrams);
+  history_trigrams = (HIST_POSTING *)NULL;
+  history_trigram_size = history_trigram_used = 0;
+  history_trigram_stale = 0;
+}
 
-  temp = (HIST_ENTRY *)xmalloc (sizeof (HIST_ENTRY));
+/* Exchange the trigram index with the table of SIZE slots, USED of them
+   in use, at *TABLE. */
+static void
+hist_trigram_swap (HIST_POSTING **table, size_t *size, size_t *used)
+{
+  HIST_POSTING *t;
+  size_t n;
+
+  t = history_trigrams;
+  history_trigrams = *table;
+  *table = t;
+  n = history_trigram_size;
+  history_trigram_size = *size;
+  *size = n;
+  n = history_trigram_used;
+  history_trigram_used = *used;
+  *used = n;
+}
 
-  temp->line = string ? savestring (string) : string;
-  temp->data = (char *)NULL;
-  temp->timestamp = ts;
+/* Put the posting lists in OLDER, a table of SIZE slots holding only
+   serial numbers smaller than any in the trigram index, in front of the
+   index's lists, and free OLDER. */
+static void
+hist_trigram_prepend (HIST_POSTING *older, size_t size)
+{
+  register size_t k;
+  HIST_POSTING *p, *o;
 
-  return temp;
+  for (k = 0; k < size; k++)
+    {
+      o = &older[k];
+      if (o->key == 0)
+	continue;
+      p = hist_trigram_find (o->key, 1);
+      if (p->n == 0)
+	{
+	  FREE (p->serials);
+	  p->serials = o->serials;
+	  p->n = o->n;
+	  p->size = o->size;
+	  continue;
+	}
+      if (p->n + o->n > p->size)
+	{
+	  p->size = p->n + o->n;
+	  p->serials = (unsigned long *)xrealloc (p->serials, p->size * sizeof (unsigned long));
+	}
+      memmove (p->serials + o->n, p->serials, p->n * sizeof (unsigned long));
+      memcpy (p->serials, o->serials, o->n * sizeof (unsigned long));
+      p->n += o->n;
+      xfree (o->serials);
+    }
+  FREE (older);
 }
 
-time_t
-history_get_time (HIST_ENTRY *hist)
+/* Build the trigram index from the entries in the list. */
+static void
+hist_trigram_build (void)
 {
-  char *ts;
-  time_t t;
+  register int i;
 
-  if (hist == 0 || hist->timestamp == 0)
-    return 0;
-  ts = hist->timestamp;
-  if (ts[0] != history_comment_char)
-    return 0;
-  errno = 0;
-  t = (time_t) strtol (ts + 1, (char **)NULL, 10);		/* XXX - should use strtol() here */
-  if (errno == ERANGE)
-    return (time_t)0;
-  return t;
+  hist_trigram_free ();
+  history_trigram_size = 1024;
+  history_trigrams = (HIST_POSTING *)xmalloc (history_trigram_size * sizeof (HIST_POSTING));
+  memset (history_trigrams, 0, history_trigram_size * sizeof (HIST_POSTING));
+  for (i = history_lazy_count; i < history_length; i++)
+    if ((HISTORY_META (i).flags & HIST_META_DEAD) == 0 && the_history[i]->line)
+      hist_trigram_add (HISTORY_META (i).serial, the_history[i]->line);
 }
 
-static char *
-hist_inittime (void)
+/* Return the offset of the next entry after POS, in direction DIR, whose
+   line might contain the LEN bytes of STRING, or -1 if there are no more.
+   Callers still have to check each entry returned.  POS may be -1 or
+   history_length to start at either end of the list.  Returns -2 if the
+   index can't help: history_use_trigrams is off or STRING is shorter than
+   a trigram. */
+int
+history_search_candidate (const char *string, int len, int pos, int dir)
 {
-  time_t t;
-  char ts[64], *ret;
+  HIST_POSTING **lists, *p;
+  unsigned long bound, serial;
+  int i, n, j;
+  size_t k;
 
-  t = (time_t) time ((time_t *)0);
-#if defined (HAVE_VSNPRINTF)		/* assume snprintf if vsnprintf exists */
-  snprintf (ts, sizeof (ts) - 1, "X%lu", (unsigned long) t);
-#else
-  sprintf (ts, "X%lu", (unsigned long) t);
-#endif
-  ret = savestring (ts);
-  ret[0] = history_comment_char;
+  if (history_use_trigrams == 0)
+    {
+      if (history_trigrams)
+	hist_trigram_free ();
+      return -2;
+    }
+  /* Too short to have a trigram; the caller scans the list.  The index
+     stays for the longer strings that usually follow. */
+  if (string == 0 || len < 3)
+    return -2;
+  HIST_SWEEP ();
+  if (hist_meta_sync () == 0)
+    return -1;
+  if (history_trigrams == 0 || history_trigram_stale > history_length)
+    hist_trigram_build ();
+
+  /* Find each trigram's list, putting the shortest first. */
+  n = len - 2;
+  lists = (HIST_POSTING **)xmalloc (n * sizeof (HIST_POSTING *));
+  for (j = 0; j < n; j++)
+    {
+      lists[j] = p = hist_trigram_find (HIST_TRIGRAM (string + j), 0);
+      if (p == 0 || p->n == 0)
+	{
+	  xfree (lists);
+	  return -1;
+	}
+      if (p->n < lists[0]->n)
+	{
+	  lists[j] = lists[0];
+	  lists[0] = p;
+	}
+    }
 
-  return ret;
+  /* Walk the shortest list from POS toward the end of the history in
+     direction DIR, returning the first entry in every list that is still
+     in the history. */
+  i = -1;
+  p = lists[0];
+  if (dir < 0)
+    {
+      bound = (pos >= history_length) ? (unsigned long)-1 : (pos > 0 ? HISTORY_META (pos).serial : 0);
+      for (k = hist_posting_bound (p, bound); i < 0 && k > 0; )
+	{
+	  serial = p->serials[--k];
+	  if (hist_trigram_match (lists, n, serial))
+	    i = hist_locate (serial);
+	}
+    }
+  else if (pos < history_length - 1)
+    {
+      bound = (pos < 0) ? 0 : HISTORY_META (pos).serial;
+      for (k = hist_posting_bound (p, bound + 1); i < 0 && k < p->n; k++)
+	{
+	  serial = p->serials[k];
+	  if (hist_trigram_match (lists, n, serial))
+	    i = hist_locate (serial);
+	}
+    }
+
+  xfree (lists);
+  return i;
 }
 
-/* Place STRING at the end of the history list.  The data field
-   is  set to NULL. */
-void
-add_history (const char *string)
+/* Place ENT at the end of the history list, making room for it as
+   add_history does.  If the history is stifled to zero entries, ENT is
+   freed instead.  Returns non-zero if ENT was added. */
+static int
+history_insert_entry (HIST_ENTRY *ent)
 {
-  HIST_ENTRY *temp;
   int new_length;
 
+  HIST_UNSHARE ();
+
+  /* A full stifled list drops its oldest entry to make room, so the dead
+     ones have to go first. */
+  if (history_dead && history_stifled && history_length >= history_max_entries)
+    hist_sweep_dead ();
+
   if (history_stifled && (history_length == history_max_entries))
     {
-      register int i;
-
       /* If the history is stifled, and history_length is zero,
 	 and it equals history_max_entries, we don't save items. */
       if (history_length == 0)
-	return;
+	{
+	  (void) free_history_entry (ent);
+	  return 0;
+	}
 
-      /* If there is something in the slot, then remove it. */
+      /* If there is something in the slot, then remove it.  If the
+	 entry is still in the backlog, drop it from there. */
       if (the_history[0])
-	(void) free_history_entry (the_history[0]);
-
-      /* Copy the rest of the entries, moving down one slot.  Copy includes
-	 trailing NULL.  */
-      memmove (the_history, the_history + 1, history_length * sizeof (HIST_ENTRY *));
+	{
+	  hist_meta_unlink (0);
+	  hist_free_slot (0);
+	}
+      else if (history_lazy_count)
+	hist_lazy_drop (1);
+
+      /* Slide the window forward one slot.  We need room for the new
+	 entry and the trailing NULL past the end of the current window.
+	 If there isn't any, make sure history_array has at least as many
+	 free slots as entries and move the entries back to the start, so
+	 we only pay for the copy once every history_length additions. */
+      if (HISTORY_WINDOW_START () + history_length + 2 > history_size)
+	{
+	  history_compact ();
+	  if (history_size < 2 * (history_length + 1))
+	    hist_resize_array (2 * (history_length + 1));
+	}
+      the_history++;
 
       new_length = history_length;
       history_base++;
@@ -299,31 +2629,198 @@ add_history (const char *string)
       if (history_size == 0)
 	{
 	  if (history_stifled && history_max_entries > 0)
-	    history_size = (history_max_entries > MAX_HISTORY_INITIAL_SIZE)
+	    hist_resize_array ((history_max_entries > MAX_HISTORY_INITIAL_SIZE)
 				? MAX_HISTORY_INITIAL_SIZE
-				: history_max_entries + 2;
+				: history_max_entries + 2);
 	  else
-	    history_size = DEFAULT_HISTORY_INITIAL_SIZE;
-	  the_history = (HIST_ENTRY **)xmalloc (history_size * sizeof (HIST_ENTRY *));
+	    hist_resize_array (DEFAULT_HISTORY_INITIAL_SIZE);
 	  new_length = 1;
 	}
       else
 	{
-	  if (history_length == (history_size - 1))
+	  if (HISTORY_WINDOW_START () + history_length == (history_size - 1))
 	    {
-	      history_size += DEFAULT_HISTORY_GROW_SIZE;
-	      the_history = (HIST_ENTRY **)
-		xrealloc (the_history, history_size * sizeof (HIST_ENTRY *));
+	      /* Reclaim the slots the window has slid past before growing. */
+	      if (HISTORY_WINDOW_START () > 0)
+		history_compact ();
+	      else
+		hist_resize_array (history_size + DEFAULT_HISTORY_GROW_SIZE);
 	    }
 	  new_length = history_length + 1;
 	}
     }
 
-  temp = alloc_history_entry ((char *)string, hist_inittime ());
-
   the_history[new_length] = (HIST_ENTRY *)NULL;
-  the_history[new_length - 1] = temp;
+  the_history[new_length - 1] = ent;
   history_length = new_length;
+  if (history_meta_valid)
+    {
+      hist_meta_set (new_length - 1, ent, ++history_serial);
+      HIST_TIME_ORDER_CHECK (new_length - 1);
+    }
+
+  return 1;
+}
+
+/* Place ENT at the end of the history list, applying the duplicate
+   policy first.  ENT is freed if it isn't added.  Returns non-zero if
+   ENT was added. */
+int
+_hs_add_history_entry (HIST_ENTRY *ent)
+{
+  int r;
+
+  if (hist_check_dups (ent->line, history_length))
+    {
+      (void) free_history_entry (ent);
+      return 0;
+    }
+  r = history_insert_entry (ent);
+  /* The copies HIST_ERASEDUPS erased are removed the next time something
+     looks at the list, or once they're half of it. */
+  if (history_dead > history_length / 2)
+    hist_sweep_dead ();
+  return r;
+}
+
+/* Add the LEN bytes of LINE, with timestamp TS, to the end of the history
+   list without applying the duplicate policy; read_history_range calls
+   _hs_history_dedup_last once the entry is complete.  If TS is NULL, use
+   the current time.  Returns non-zero if the line was added. */
+int
+_hs_add_history_line (const char *line, size_t len, const char *ts)
+{
+  HIST_ENTRY *temp;
+
+  if (history_use_arena)
+    temp = hist_arena_entry (line, len, ts);
+  else
+    {
+      temp = alloc_history_entry ((char *)NULL, ts ? savestring (ts) : hist_inittime ());
+      temp->line = hist_line (line);
+    }
+  return (history_insert_entry (temp));
+}
+
+/* Add a copy of LINE to the end of the history list, applying the
+   duplicate policy, without publishing it to the shared history ring: it
+   came from there, along with TIME, the time from its timestamp.  The
+   timestamp is rebuilt with our history_comment_char, as hist_inittime
+   builds one.  Returns non-zero if the line was added. */
+int
+_hs_add_history_shared (const char *line, const char *time)
+{
+  HIST_ENTRY *ent;
+  char *ts;
+
+  if (*time == '\0')
+    ts = hist_inittime ();
+  else
+    {
+      ts = (char *)xmalloc (strlen (time) + 2);
+      ts[0] = history_comment_char;
+      strcpy (ts + 1, time);
+    }
+  ent = alloc_history_entry ((char *)NULL, ts);
+  ent->line = hist_line (line);
+  return (_hs_add_history_entry (ent));
+}
+
+/* Place STRING at the end of the history list.  The data field
+   is  set to NULL. */
+void
+add_history (const char *string)
+{
+  HIST_ENTRY *ent;
+  char *ts;
+
+  ts = hist_inittime ();
+  _hs_history_share_publish (string, ts);
+  /* Intern the line before copying it, so a line that is already interned
+     isn't copied at all. */
+  ent = alloc_history_entry ((char *)NULL, ts);
+  ent->line = hist_line (string);
+  _hs_add_history_entry (ent);
+}
+
+/* Place the N lines in LINES at the end of the history list, as add_history
+   would one at a time, with the timestamps in TIMESTAMPS if it's non-null.
+   The list is grown once, duplicates erased under HIST_ERASEDUPS are
+   removed together, and if the history is stifled, the oldest entries are
+   dropped all at once at the end, so adding N lines takes time
+   proportional to N rather than to N times the length of the list.  The
+   duplicate policy sees the whole list before it's stifled. */
+void
+add_history_batch (const char **lines, const char **timestamps, int n)
+{
+  register int i;
+  int first, excess;
+  HIST_ENTRY *ent;
+  char *ts;
+
+  if (lines == 0 || n <= 0 || (history_stifled && history_max_entries == 0))
+    return;
+  HIST_UNSHARE ();
+
+  /* Lines that would be pushed out by later ones aren't worth adding,
+     though they still count toward history_base and are still shared. */
+  first = 0;
+  if (history_stifled && history_dup_policy == HIST_KEEPDUPS && n > history_max_entries)
+    {
+      first = n - history_max_entries;
+      for (i = 0; i < first; i++)
+	_hs_history_share_publish (lines[i], timestamps ? timestamps[i] : (char *)NULL);
+      history_base += first;
+    }
+
+  /* Make room for all of them. */
+  if (HISTORY_WINDOW_START () + history_length + (n - first) + 1 > history_size)
+    {
+      history_compact ();
+      if (history_size < history_length + (n - first) + 1)
+	hist_resize_array (history_length + (n - first) + DEFAULT_HISTORY_GROW_SIZE);
+    }
+
+  for (i = first; i < n; i++)
+    {
+      ts = (timestamps && timestamps[i]) ? savestring (timestamps[i]) : hist_inittime ();
+      _hs_history_share_publish (lines[i], ts);
+      ent = alloc_history_entry ((char *)NULL, ts);
+      ent->line = hist_line (lines[i]);
+      if (hist_check_dups (ent->line, history_length))
+	{
+	  (void) free_history_entry (ent);
+	  continue;
+	}
+      the_history[history_length++] = ent;
+      the_history[history_length] = (HIST_ENTRY *)NULL;
+      if (history_meta_valid)
+	{
+	  hist_meta_set (history_length - 1, ent, ++history_serial);
+	  HIST_TIME_ORDER_CHECK (history_length - 1);
+	}
+    }
+  if (history_dead)
+    hist_sweep_dead ();
+
+  if (history_stifled)
+    {
+      hist_lazy_stifle (history_max_entries);
+      if (history_length > history_max_entries)
+	{
+	  /* Slide the window past the oldest entries, as history_insert_entry
+	     does for one. */
+	  excess = history_length - history_max_entries;
+	  for (i = 0; i < excess; i++)
+	    {
+	      hist_meta_unlink (i);
+	      hist_free_slot (i);
+	    }
+	  the_history += excess;
+	  history_length -= excess;
+	  history_base += excess;
+	}
+    }
 }
 
 /* Change the time stamp of the most recent history entry to STRING. */
@@ -334,9 +2831,18 @@ add_history_time (const char *string)
 
   if (string == 0 || history_length < 1)
     return;
+  hist_own_entry (history_length - 1);
   hs = the_history[history_length - 1];
-  FREE (hs->timestamp);
+  hist_arena_free_string (hs->timestamp, history_arena_count ? hist_arena_find (hs) : 0);
   hs->timestamp = savestring (string);
+  if (history_meta_valid)
+    {
+      history_timestamp_bytes -= HISTORY_META (history_length - 1).tslen;
+      HISTORY_META (history_length - 1).tslen = strlen (string);
+      history_timestamp_bytes += HISTORY_META (history_length - 1).tslen;
+      HISTORY_META (history_length - 1).time = hist_parse_time (string);
+      HIST_TIME_ORDER_CHECK (history_length - 1);
+    }
 }
 
 /* Free HIST and return the data so the calling application can free it
@@ -345,10 +2851,23 @@ histdata_t
 free_history_entry (HIST_ENTRY *hist)
 {
   histdata_t x;
+  HIST_ARENA *a;
 
   if (hist == 0)
     return ((histdata_t) 0);
-  FREE (hist->line);
+
+  /* Entries allocated from an arena block share it with their line and
+     timestamp, unless those have been replaced since. */
+  if (history_arena_count && (a = hist_arena_find (hist)))
+    {
+      hist_free_line (hist->line, a);
+      hist_arena_free_string (hist->timestamp, a);
+      x = hist->data;
+      hist_arena_release (a);
+      return (x);
+    }
+
+  hist_free_line (hist->line, (HIST_ARENA *)NULL);
   FREE (hist->timestamp);
   x = hist->data;
   xfree (hist);
@@ -366,7 +2885,7 @@ copy_history_entry (HIST_ENTRY *hist)
 
   ret = alloc_history_entry (hist->line, (char *)NULL);
 
-  ts = hist->timestamp ? savestring (hist->timestamp) : hist->timestamp;
+  ts = hist->timestamp ? hist_savetime (hist->timestamp) : hist->timestamp;
   ret->timestamp = ts;
 
   ret->data = hist->data;
@@ -382,18 +2901,22 @@ replace_history_entry (int which, const char *line, histdata_t data)
 {
   HIST_ENTRY *temp, *old_value;
 
+  HIST_SWEEP ();
   if (which < 0 || which >= history_length)
     return ((HIST_ENTRY *)NULL);
+  HIST_LAZY_MAKE (which);
+  hist_own_entry (which);
 
   temp = (HIST_ENTRY *)xmalloc (sizeof (HIST_ENTRY));
   old_value = the_history[which];
 
-  temp->line = savestring (line);
+  temp->line = hist_line (line);
   temp->data = data;
-  temp->timestamp = savestring (old_value->timestamp);
+  temp->timestamp = hist_savetime (old_value->timestamp);
   the_history[which] = temp;
+  hist_meta_update (which);
 
-  return (old_value);
+  return (hist_escape_entry (old_value));
 }
 
 /* Append LINE to the history line at offset WHICH, adding a newline to the
@@ -406,6 +2929,8 @@ _hs_append_history_line (int which, const char *line)
   size_t newlen, curlen, minlen;
   char *newline;
 
+  HIST_LAZY_MAKE (which);
+  hist_own_entry (which);
   hent = the_history[which];
   curlen = strlen (hent->line);
   minlen = curlen + strlen (line) + 2;	/* min space needed */
@@ -419,13 +2944,25 @@ _hs_append_history_line (int which, const char *line)
   else
     newlen = minlen;
   /* Assume that realloc returns the same pointer and doesn't try a new
-     alloc/copy if the new size is the same as the one last passed. */
-  newline = realloc (hent->line, newlen);
+     alloc/copy if the new size is the same as the one last passed.  A
+     line in an arena block or an interned one has to be copied out first. */
+  if ((history_arena_count && hist_arena_find (hent->line)) || (history_istrs && hist_istr_find (hent->line)))
+    {
+      newline = malloc (newlen);
+      if (newline)
+	{
+	  strcpy (newline, hent->line);
+	  hist_free_line (hent->line, history_arena_count ? hist_arena_find (hent) : 0);
+	}
+    }
+  else
+    newline = realloc (hent->line, newlen);
   if (newline)
     {
       hent->line = newline;
       hent->line[curlen++] = '\n';
       strcpy (hent->line + curlen, line);
+      hist_meta_update (which);
     }
 }
 
@@ -440,73 +2977,116 @@ _hs_replace_history_data (int which, histdata_t *old, histdata_t *new)
 {
   HIST_ENTRY *entry;
   register int i, last;
+  unsigned long serial;
+  size_t k;
 
   if (which < -2 || which >= history_length || history_length == 0 || the_history == 0)
     return;
 
+  /* Entries still in the backlog have no data, so they are skipped here
+     rather than made, and replacing data with itself changes nothing. */
+  if (old == new)
+    return;
   if (which >= 0)
     {
+      if (which < history_lazy_count && old)
+	return;
+      HIST_LAZY_MAKE (which);
       entry = the_history[which];
       if (entry && entry->data == old)
-	entry->data = new;
+	hist_set_data (which, new);
+      return;
+    }
+
+  /* Look up the entries holding OLD in the data index instead of checking
+     every entry.  Every change to an entry's data goes through the index,
+     so if it lists no entry holding OLD, there is none. */
+  if (old)
+    {
+      if (hist_meta_sync () == 0)
+	return;
+      do
+	{
+	  last = -1;
+	  k = (size_t)-1;
+	  while (serial = hist_table_next (&history_data_index, HIST_PTR_HASH (old), &k))
+	    {
+	      i = hist_locate (serial);
+	      if (i < 0 || the_history[i] == 0 || the_history[i]->data != old)
+		continue;
+	      if (which == -1)
+		break;
+	      if (i > last)
+		last = i;
+	    }
+	  /* Changing the data changes the index, so start over after each
+	     replacement. */
+	  if (which == -1 && serial)
+	    hist_set_data (i, new);
+	}
+      while (which == -1 && serial && new != old);
+      if (which == -2 && last >= 0)
+	hist_set_data (last, new);	/* XXX - we don't check entry->old */
       return;
     }
 
   last = -1;
-  for (i = 0; i < history_length; i++)
+  for (i = history_lazy_count; i < history_length; i++)
     {
       entry = the_history[i];
-      if (entry == 0)
-	continue;
-      if (entry->data == old)
+      if (entry && entry->data == old)
 	{
 	  last = i;
 	  if (which == -1)
-	    entry->data = new;
+	    hist_set_data (i, new);
 	}
     }
   if (which == -2 && last >= 0)
-    {
-      entry = the_history[last];
-      entry->data = new;	/* XXX - we don't check entry->old */
-    }
-}      
-  
-/* Remove history element WHICH from the history.  The removed
-   element is returned to you so you can free the line, data,
-   and containing structure. */
-HIST_ENTRY *
-remove_history (int which)
+    hist_set_data (last, new);	/* XXX - we don't check entry->old */
+}
+
+/* Take entry WHICH out of the history list and return it. */
+static HIST_ENTRY *
+hist_remove_entry (int which)
 {
   HIST_ENTRY *return_value;
-  register int i;
-#if 1
   int nentries;
   HIST_ENTRY **start, **end;
-#endif
-
-  if (which < 0 || which >= history_length || history_length ==  0 || the_history == 0)
-    return ((HIST_ENTRY *)NULL);
 
+  HIST_UNSHARE ();
   return_value = the_history[which];
+  hist_meta_unlink (which);
 
-#if 1
   /* Copy the rest of the entries, moving down one slot.  Copy includes
      trailing NULL.  */
   nentries = history_length - which;
   start = the_history + which;
   end = start + 1;
   memmove (start, end, nentries * sizeof (HIST_ENTRY *));
-#else
-  for (i = which; i < history_length; i++)
-    the_history[i] = the_history[i + 1];
-#endif
+  if (history_meta_valid)
+    memmove (&HISTORY_META (which), &HISTORY_META (which + 1), (nentries - 1) * sizeof (HIST_META));
 
   history_length--;
 
   return (return_value);
 }
 
+/* Remove history element WHICH from the history.  The removed
+   element is returned to you so you can free the line, data,
+   and containing structure. */
+HIST_ENTRY *
+remove_history (int which)
+{
+  HIST_SWEEP ();
+  if (which < 0 || which >= history_length || history_length ==  0 || the_history == 0)
+    return ((HIST_ENTRY *)NULL);
+
+  /* Only the entries after WHICH move, and they've all been made. */
+  HIST_LAZY_MAKE (which);
+  hist_own_entry (which);
+  return (hist_escape_entry (hist_remove_entry (which)));
+}
+
 HIST_ENTRY **
 remove_history_range (int first, int last)
 {
@@ -515,12 +3095,15 @@ remove_history_range (int first, int last)
   int nentries;
   HIST_ENTRY **start, **end;
 
+  HIST_SWEEP ();
   if (the_history == 0 || history_length == 0)
     return ((HIST_ENTRY **)NULL);
   if (first < 0 || first >= history_length || last < 0 || last >= history_length)
     return ((HIST_ENTRY **)NULL);
   if (first > last)
     return (HIST_ENTRY **)NULL;
+  HIST_LAZY_MAKE (first);
+  HIST_UNSHARE ();
 
   nentries = last - first + 1;
   return_value = (HIST_ENTRY **)malloc ((nentries + 1) * sizeof (HIST_ENTRY *));
@@ -529,7 +3112,11 @@ remove_history_range (int first, int last)
 
   /* Return all the deleted entries in a list */
   for (i = first ; i <= last; i++)
-    return_value[i - first] = the_history[i];
+    {
+      hist_own_entry (i);
+      hist_meta_unlink (i);
+      return_value[i - first] = hist_escape_entry (the_history[i]);
+    }
   return_value[i - first] = (HIST_ENTRY *)NULL;
 
   /* Copy the rest of the entries, moving down NENTRIES slots.  Copy includes
@@ -537,12 +3124,72 @@ remove_history_range (int first, int last)
   start = the_history + first;
   end = the_history + last + 1;
   memmove (start, end, (history_length - last) * sizeof (HIST_ENTRY *));
+  if (history_meta_valid)
+    memmove (&HISTORY_META (first), &HISTORY_META (last + 1), (history_length - last - 1) * sizeof (HIST_META));
 
   history_length -= nentries;
 
   return (return_value);
 }
 
+/* Remove every entry in the history list for which PREDICATE, called with
+   the entry and CTX, returns non-zero, moving the rest down in a single
+   pass.  PREDICATE must not change the history list.  history_offset is
+   adjusted to stay on the same entry, or the next one kept.  Returns a
+   NULL-terminated array of the removed entries, oldest first, for the
+   caller to free along with the array, or NULL if none were removed. */
+HIST_ENTRY **
+history_remove_if (rl_hist_predicate_func_t *predicate, void *ctx)
+{
+  HIST_ENTRY **removed;
+  register int i, j;
+  int n, size, offset;
+
+  HIST_SWEEP ();
+  hist_lazy_fill (-1);
+  if (the_history == 0 || history_length == 0 || predicate == 0)
+    return ((HIST_ENTRY **)NULL);
+  HIST_UNSHARE ();
+
+  removed = (HIST_ENTRY **)NULL;
+  n = size = 0;
+  offset = history_offset;
+  for (i = j = 0; i < history_length; i++)
+    {
+      if ((*predicate) (the_history[i], ctx))
+	{
+	  hist_own_entry (i);
+	  hist_meta_unlink (i);
+	  if (n + 1 >= size)
+	    {
+	      size = size ? 2 * size : 16;
+	      removed = (HIST_ENTRY **)xrealloc (removed, size * sizeof (HIST_ENTRY *));
+	    }
+	  removed[n++] = the_history[i];
+	  if (i < history_offset)
+	    offset--;
+	  continue;
+	}
+      if (j < i)
+	{
+	  the_history[j] = the_history[i];
+	  if (history_meta_valid)
+	    HISTORY_META (j) = HISTORY_META (i);
+	}
+      j++;
+    }
+  the_history[j] = (HIST_ENTRY *)NULL;
+  history_length = j;
+  history_offset = offset;
+
+  if (n == 0)
+    return ((HIST_ENTRY **)NULL);
+  for (i = 0; i < n; i++)
+    removed[i] = hist_escape_entry (removed[i]);
+  removed[n] = (HIST_ENTRY *)NULL;
+  return (removed);
+}
+
 /* Stifle the history list, remembering only MAX number of lines. */
 void
 stifle_history (int max)
@@ -552,15 +3199,26 @@ stifle_history (int max)
   if (max < 0)
     max = 0;
 
+  HIST_SWEEP ();
+  hist_lazy_stifle (max);
+
   if (history_length > max)
     {
+      HIST_UNSHARE ();
       /* This loses because we cannot free the data. */
       for (i = 0, j = history_length - max; i < j; i++)
-	free_history_entry (the_history[i]);
+	{
+	  hist_meta_unlink (i);
+	  hist_free_slot (i);
+	}
 
       history_base = i;
       for (j = 0, i = history_length - max; j < max; i++, j++)
-	the_history[j] = the_history[i];
+	{
+	  the_history[j] = the_history[i];
+	  if (history_meta_valid)
+	    HISTORY_META (j) = HISTORY_META (i);
+	}
       the_history[j] = (HIST_ENTRY *)NULL;
       history_length = j;
     }
@@ -590,18 +3248,54 @@ history_is_stifled (void)
   return (history_stifled);
 }
 
+/* Free every entry in the history list and everything the library
+   keeps about them, leaving history_base alone.  rl_clear_history uses
+   this once it has freed readline's undo lists. */
 void
-clear_history (void)
+_hs_clear_history_entries (void)
 {
   register int i;
 
+  /* The snapshots sharing the list keep its entries. */
+  if (history_shared)
+    {
+      hist_shared_save_gens (history_shared);
+      hist_shared_release (history_shared);
+      history_shared = (HIST_SHARED *)NULL;
+      history_array = the_history = (HIST_ENTRY **)NULL;
+      history_size = history_length = 0;
+    }
+
   /* This loses because we cannot free the data. */
   for (i = 0; i < history_length; i++)
     {
-      free_history_entry (the_history[i]);
+      if (HIST_BORROWED (i) == 0)
+	free_history_entry (the_history[i]);
       the_history[i] = (HIST_ENTRY *)NULL;
     }
+  hist_borrow_release ();
+
+  hist_table_free (&history_dup_index);
+  hist_table_free (&history_data_index);
+  hist_trigram_free ();
+  hist_lazy_free ();
+  history_dead = 0;
+  history_line_bytes = history_timestamp_bytes = 0;
+  history_times_unordered = 0;
+
+  /* Start over at the beginning of the allocated array. */
+  if (the_history)
+    {
+      the_history = history_array;
+      the_history[0] = (HIST_ENTRY *)NULL;
+    }
 
   history_offset = history_length = 0;
+}
+
+void
+clear_history (void)
+{
+  _hs_clear_history_entries ();
   history_base = 1;		/* reset history base to default */
 }
@@ -61,9 +61,44 @@ typedef struct _hist_state {
   int flags;
 } HISTORY_STATE;
 
+/* A saved copy of the history list, made by history_snapshot().  Its
+   contents are private to the library. */
+typedef struct _hist_snapshot HISTORY_SNAPSHOT;
+
+/* Where read_history_since() left off reading a history file. */
+typedef struct _hist_cookie {
+  unsigned long dev;		/* The file that was read. */
+  unsigned long ino;
+  unsigned long offset;		/* How much of it has been read. */
+  unsigned int check;		/* Hash of the bytes just before OFFSET. */
+  unsigned int lastline;	/* Hash of the line just before OFFSET. */
+} HISTORY_COOKIE;
+
+/* The memory the history list is using, as reported by
+   history_memory_usage(). */
+typedef struct _hist_usage {
+  int entries;			/* Number of entries in the list. */
+  size_t line_bytes;		/* Their lines, counting the NULs, once. */
+  size_t line_bytes_shared;	/* Line bytes saved by interning. */
+  size_t timestamp_bytes;	/* Their timestamps, counting the NULs. */
+  size_t entry_bytes;		/* The HIST_ENTRY structures. */
+  size_t list_bytes;		/* The history array and per-entry bookkeeping. */
+  size_t index_bytes;		/* The duplicate, data, and trigram indexes. */
+  size_t total;			/* All of the above. */
+} HISTORY_USAGE;
+
+/* A function that decides whether history_remove_if() removes an entry. */
+typedef int rl_hist_predicate_func_t PARAMS((HIST_ENTRY *, void *));
+
 /* Flag values for the `flags' member of HISTORY_STATE. */
 #define HS_STIFLED	0x01
 
+/* Duplicate policies for history_set_dup_policy. */
+#define HIST_KEEPDUPS		0	/* add every line */
+#define HIST_IGNOREDUPS		1	/* don't add a copy of the previous line */
+#define HIST_IGNOREALLDUPS	2	/* don't add a line already in the list */
+#define HIST_ERASEDUPS		3	/* remove earlier copies, then add */
+
 /* Initialization and state management. */
 
 /* Begin a session in which the history functions might be used.  This
@@ -76,6 +111,17 @@ extern HISTORY_STATE *history_get_history_state PARAMS((void));
 /* Set the state of the current history array to STATE. */
 extern void history_set_history_state PARAMS((HISTORY_STATE *));
 
+/* Return a snapshot of the history list, sharing its entries until one
+   or the other changes. */
+extern HISTORY_SNAPSHOT *history_snapshot PARAMS((void));
+
+/* Make the history list the one saved in SNAPSHOT, discarding the
+   current one. */
+extern void history_restore_snapshot PARAMS((HISTORY_SNAPSHOT *));
+
+/* Free SNAPSHOT. */
+extern void history_free_snapshot PARAMS((HISTORY_SNAPSHOT *));
+
 /* Manage the history list. */
 
 /* Place STRING at the end of the history list.
@@ -86,6 +132,11 @@ extern void add_history PARAMS((const char *));
    STRING. */
 extern void add_history_time PARAMS((const char *));
 
+/* Place the N strings in LINES at the end of the history list, with the
+   timestamps in TIMESTAMPS if it's non-NULL, growing and stifling the
+   list only once. */
+extern void add_history_batch PARAMS((const char **, const char **, int));
+
 /* Remove an entry from the history list.  WHICH is the magic number that
    tells us which element to delete.  The elements are numbered from 0. */
 extern HIST_ENTRY *remove_history PARAMS((int));
@@ -93,6 +144,11 @@ extern HIST_ENTRY *remove_history PARAMS((int));
 /* Remove a set of entries from the history list: FIRST to LAST, inclusive */
 extern HIST_ENTRY **remove_history_range PARAMS((int, int));
 
+/* Remove every entry for which PREDICATE, called with the entry and CTX,
+   returns non-zero, in one pass.  Returns a NULL-terminated array of the
+   removed entries, or NULL if none were removed. */
+extern HIST_ENTRY **history_remove_if PARAMS((rl_hist_predicate_func_t *, void *));
+
 /* Allocate a history entry consisting of STRING and TIMESTAMP and return
    a pointer to it. */
 extern HIST_ENTRY *alloc_history_entry PARAMS((char *, char *));
@@ -112,6 +168,11 @@ extern HIST_ENTRY *replace_history_entry PARAMS((int, const char *, histdata_t))
 /* Clear the history list and start over. */
 extern void clear_history PARAMS((void));
 
+/* Set what add_history does with a line that is already in the history
+   list to POLICY, one of the HIST_*DUPS values above.  Returns the
+   previous policy. */
+extern int history_set_dup_policy PARAMS((int));
+
 /* Stifle the history list, remembering only MAX number of entries. */
 extern void stifle_history PARAMS((int));
 
@@ -146,10 +207,23 @@ extern HIST_ENTRY *history_get PARAMS((int));
    argument */
 extern time_t history_get_time PARAMS((HIST_ENTRY *));
 
+/* Return the offset of the oldest history entry whose timestamp is T or
+   later, or -1 if there isn't one. */
+extern int history_find_first_after PARAMS((time_t));
+
+/* Return a NULL terminated array of the history entries with timestamps
+   from T0 through T1, oldest first, or NULL if there are none.  Only the
+   array, not the entries, should be freed. */
+extern HIST_ENTRY **history_range_between PARAMS((time_t, time_t));
+
 /* Return the number of bytes that the primary history entries are using.
-   This just adds up the lengths of the_history->lines. */
+   This is the sum of the lengths of the_history->lines and timestamps. */
 extern int history_total_bytes PARAMS((void));
 
+/* Fill in the HISTORY_USAGE structure with the memory the history list,
+   its entries, and the library's bookkeeping are using. */
+extern void history_memory_usage PARAMS((HISTORY_USAGE *));
+
 /* Moving around the history list. */
 
 /* Set the position in the history list to POS. */
@@ -187,6 +261,13 @@ extern int history_search_prefix PARAMS((const char *, int));
    was found, or -1 otherwise. */
 extern int history_search_pos PARAMS((const char *, int, int));
 
+/* Return the offset of the next entry after POS, in direction DIR, whose
+   line might contain the LEN bytes of STRING, using a trigram index of
+   the history list.  Returns -1 if there are no more such entries, or -2
+   if the index can't be used: history_use_trigrams is zero or LEN is
+   less than three. */
+extern int history_search_candidate PARAMS((const char *, int, int, int));
+
 /* Managing the history file. */
 
 /* Add the contents of FILENAME to the history list, a line at a time.
@@ -201,6 +282,12 @@ extern int read_history PARAMS((const char *));
    ~/.history.  Returns 0 if successful, or errno if not. */
 extern int read_history_range PARAMS((const char *, int, int));
 
+/* Add the entries appended to FILENAME since the last call with COOKIE,
+   which should be zeroed before the first call.  If the file has been
+   truncated or replaced since, read what follows the part of it that was
+   read before, or all of it if none of that is left. */
+extern int read_history_since PARAMS((const char *, HISTORY_COOKIE *));
+
 /* Write the current history to FILENAME.  If FILENAME is NULL,
    then write the history list to ~/.history.  Values returned
    are as in read_history ().  */
@@ -210,6 +297,24 @@ extern int write_history PARAMS((const char *));
    the end of the list minus NELEMENTs up to the end of the list. */
 extern int append_history PARAMS((int, const char *));
 
+/* Write the entries queued by append_history() when history_async_append
+   is set, and wait for them to be written.  Returns 0 or the errno from
+   the first write that failed. */
+extern int history_flush PARAMS((void));
+
+/* Share history lines with the other sessions using FILENAME, a ring
+   buffer of SIZE bytes (a default size if SIZE is 0), creating it if the
+   file doesn't exist or is empty.  Returns 0 or errno; EINVAL if FILENAME
+   holds something other than a ring. */
+extern int history_share_open PARAMS((const char *, size_t));
+
+/* Add the lines other sessions have added to the shared ring since the
+   last call to the history list.  Returns the number of lines added. */
+extern int history_share_sync PARAMS((void));
+
+/* Stop sharing history lines with other sessions. */
+extern void history_share_close PARAMS((void));
+
 /* Truncate the history file, leaving only the last NLINES lines. */
 extern int history_truncate_file PARAMS((const char *, int));
 
@@ -267,6 +372,29 @@ extern int history_quoting_state;
 
 extern int history_write_timestamps;
 
+extern int history_use_arena;
+extern int history_use_index;
+
+/* If non-zero, read_history() makes HIST_ENTRYs for only the newest few
+   hundred entries when it reads a whole history file into an empty list,
+   and the rest as they're needed.  history_length and history_base count
+   them all; history_get() and the other functions that return entries
+   make the ones they return, and history_list() makes them all. */
+extern int history_lazy_read;
+extern int history_use_trigrams;
+extern int history_intern_lines;
+extern int history_search_threads;
+extern int history_search_threshold;
+
+/* If non-zero, append_history() queues entries and writes them later.
+   Nothing writes the queue at exit: call history_flush() before exiting
+   or unloading the library.  history_flush() with history_async_append
+   set back to 0 also stops the thread that writes the queue. */
+extern int history_async_append;
+extern int history_append_batch;
+extern int history_append_latency;
+extern int history_append_fsync;
+
 /* These two are undocumented; the second is reserved for future use */
 extern int history_multiline_entries;
 extern int history_file_version;
@@ -43,6 +43,16 @@
 #  include <fnmatch.h>
 #endif
 
+#if defined (HAVE_LOCALE_H)
+#  include <locale.h>
+#endif
+
+#include <ctype.h>
+
+#if defined (HISTORY_USE_PTHREADS)
+#  include <pthread.h>
+#endif
+
 #include "history.h"
 #include "histlib.h"
 #include "xmalloc.h"
@@ -51,8 +61,641 @@
    string. */
 char *history_search_delimiter_chars = (char *)NULL;
 
+/* A substring search compiled for searching lines in either direction
+   with the Boyer-Moore-Horspool algorithm. */
+typedef struct _hist_matcher {
+  const char *pat;
+  size_t len;
+  size_t fskip[256];	/* forward shift, by the last character in the window */
+  size_t rskip[256];	/* reverse shift, by the first character in the window */
+} HIST_MATCHER;
+
+/* One element of a compiled glob pattern: a character, `?', a bracket
+   expression, or a run of `*'s. */
+typedef struct _hist_glob_atom {
+  int op;
+  unsigned char c;		/* HIST_GLOB_CHAR */
+  unsigned char set[32];	/* HIST_GLOB_SET: one bit per character */
+} HIST_GLOB_ATOM;
+
+#define HIST_GLOB_CHAR	0
+#define HIST_GLOB_ANY	1
+#define HIST_GLOB_SET	2
+#define HIST_GLOB_STAR	3
+
+#define HIST_GLOB_ISSET(a, c)	((a)->set[(c) >> 3] & (1 << ((c) & 7)))
+#define HIST_GLOB_ADDSET(a, c)	((a)->set[(c) >> 3] |= (1 << ((c) & 7)))
+
+/* A glob pattern compiled for searching.  ATOMS is null if the pattern
+   uses something we leave to fnmatch, such as `?' in a multibyte locale
+   or a range in a locale with its own collating order.  Either way, a
+   matching line has to be at least MINLEN characters long and contain
+   LITERAL, the longest run of ordinary characters in the pattern. */
+typedef struct _hist_glob {
+  HIST_GLOB_ATOM *atoms;
+  int natoms;
+  int minlen;
+  char *litbuf;
+  HIST_MATCHER literal;		/* LEN is 0 if there's no literal text */
+} HIST_GLOB;
+
+/* What history_search_internal is looking for, and how. */
+typedef struct _hist_search {
+  const char *string;
+  int string_len;
+  int anchored;
+  int patsearch;
+  int reverse;
+  unsigned long need;		/* HISTORY_CHAR_BITs a matching line has */
+  HIST_MATCHER matcher;
+  HIST_GLOB glob;
+} HIST_SEARCH;
+
+#if defined (HISTORY_USE_PTHREADS)
+/* A search of NLINES lines of LIST, starting at START and moving in the
+   search direction, shared by several threads.  The lines are divided
+   into NCHUNKS chunks of CHUNK lines, numbered in the order the search
+   would reach them, and each thread takes the next chunk nobody has
+   searched yet.  FOUND is the first chunk known to contain a match, and
+   no chunk after it needs to be searched. */
+typedef struct _hist_search_job {
+  const HIST_SEARCH *search;
+  HIST_ENTRY **list;
+  int start;
+  int nlines;
+  int chunk;
+  int nchunks;
+  pthread_mutex_t lock;
+  int next;			/* next chunk to hand out */
+  int found;			/* NCHUNKS if none has a match yet */
+  int line;			/* the match in chunk FOUND */
+  int offset;
+} HIST_SEARCH_JOB;
+
+#define HIST_SEARCH_CHUNK	4096
+#define HIST_SEARCH_MAXTHREADS	256
+#endif
+
+static void hist_matcher_init PARAMS((HIST_MATCHER *, const char *, size_t));
+static int hist_match_forward PARAMS((const HIST_MATCHER *, const char *, size_t));
+static int hist_match_reverse PARAMS((const HIST_MATCHER *, const char *, size_t));
+
+#if defined (HAVE_FNMATCH)
+static int hist_glob_rational_ranges PARAMS((void));
+static int hist_glob_class PARAMS((HIST_GLOB_ATOM *, const char *, int));
+static int hist_glob_bracket PARAMS((HIST_GLOB_ATOM *, const char *));
+static void hist_glob_compile PARAMS((HIST_GLOB *, const char *));
+static void hist_glob_free PARAMS((HIST_GLOB *));
+static int hist_glob_match PARAMS((const HIST_SEARCH *, const char *, int));
+static int hist_glob_search PARAMS((const HIST_SEARCH *, const char *, int));
+#endif
+
+static unsigned long hist_string_chars PARAMS((const char *, size_t));
+static int hist_search_line PARAMS((const HIST_SEARCH *, const char *, int));
+static int hist_search_entry PARAMS((const HIST_SEARCH *, HIST_ENTRY **, int));
+#if defined (HISTORY_USE_PTHREADS)
+static void *hist_search_worker PARAMS((void *));
+static int hist_search_parallel PARAMS((const HIST_SEARCH *, HIST_ENTRY **, int, int, int *));
+#endif
 static int history_search_internal PARAMS((const char *, int, int));
 
+/* If greater than one, the number of threads used to search at least
+   history_search_threshold lines of the history list. */
+int history_search_threads = 0;
+int history_search_threshold = 100000;
+
+static void
+hist_matcher_init (HIST_MATCHER *m, const char *pat, size_t len)
+{
+  size_t i;
+
+  m->pat = pat;
+  m->len = len;
+  for (i = 0; i < 256; i++)
+    m->fskip[i] = m->rskip[i] = len;
+  for (i = 0; i + 1 < len; i++)
+    m->fskip[(unsigned char)pat[i]] = len - 1 - i;
+  for (i = len - 1; i > 0; i--)
+    m->rskip[(unsigned char)pat[i]] = i;
+}
+
+/* Return the offset of the first occurrence of M's pattern in LINE, which
+   is LEN characters long, or -1. */
+static int
+hist_match_forward (const HIST_MATCHER *m, const char *line, size_t len)
+{
+  const char *p;
+#if !defined (HAVE_MEMMEM)
+  size_t i, last;
+  unsigned char c;
+#endif
+
+  if (m->len > len)
+    return -1;
+  if (m->len == 1)
+    {
+      p = memchr (line, m->pat[0], len);
+      return (p ? p - line : -1);
+    }
+#if defined (HAVE_MEMMEM)
+  /* The C library's version is usually faster than anything we'd write. */
+  p = memmem (line, len, m->pat, m->len);
+  return (p ? p - line : -1);
+#else
+  last = m->len - 1;
+  for (i = 0; i + last < len; i += m->fskip[c])
+    {
+      c = line[i + last];
+      if (c == (unsigned char)m->pat[last] && memcmp (line + i, m->pat, last) == 0)
+	return i;
+    }
+  return -1;
+#endif
+}
+
+/* Return the offset of the last occurrence of M's pattern in LINE, which
+   is LEN characters long, or -1. */
+static int
+hist_match_reverse (const HIST_MATCHER *m, const char *line, size_t len)
+{
+  size_t i, skip;
+  unsigned char c;
+
+  if (m->len > len)
+    return -1;
+  for (i = len - m->len; ; i -= skip)
+    {
+      c = line[i];
+      if (c == (unsigned char)m->pat[0] && memcmp (line + i + 1, m->pat + 1, m->len - 1) == 0)
+	return i;
+      skip = m->rskip[c];
+      if (skip > i)
+	return -1;
+    }
+}
+
+#if defined (HAVE_FNMATCH)
+/* Non-zero if a range in a bracket expression means the characters whose
+   codes fall between its ends, as it does in the C locale. */
+static int
+hist_glob_rational_ranges (void)
+{
+#if defined (HAVE_SETLOCALE) && defined (LC_COLLATE)
+  char *l;
+
+  l = setlocale (LC_COLLATE, (char *)NULL);
+  return (l == 0 || STREQ (l, "C") || STREQ (l, "POSIX"));
+#else
+  return 1;
+#endif
+}
+
+/* Add the characters in the character class NAME, which is LEN characters
+   long, to A's set.  Returns 0 if NAME isn't a class we know. */
+static int
+hist_glob_class (HIST_GLOB_ATOM *a, const char *name, int len)
+{
+  static const char * const classes[] = {
+    "alnum", "alpha", "blank", "cntrl", "digit", "graph",
+    "lower", "print", "punct", "space", "upper", "xdigit", 0
+  };
+  int k, c, in;
+
+  for (k = 0; classes[k]; k++)
+    if (strlen (classes[k]) == (size_t)len && strncmp (classes[k], name, len) == 0)
+      break;
+  if (classes[k] == 0)
+    return 0;
+  for (c = 1; c < 256; c++)
+    {
+      switch (k)
+	{
+	case 0: in = isalnum (c); break;
+	case 1: in = isalpha (c); break;
+	case 2: in = (c == ' ' || c == '\t'); break;
+	case 3: in = iscntrl (c); break;
+	case 4: in = isdigit (c); break;
+	case 5: in = isgraph (c); break;
+	case 6: in = islower (c); break;
+	case 7: in = isprint (c); break;
+	case 8: in = ispunct (c); break;
+	case 9: in = isspace (c); break;
+	case 10: in = isupper (c); break;
+	default: in = isxdigit (c); break;
+	}
+      if (in)
+	HIST_GLOB_ADDSET (a, c);
+    }
+  return 1;
+}
+
+/* Compile the bracket expression starting at PAT, just past the `[', into
+   A.  Returns the number of characters of PAT it used, 0 if there's no
+   closing `]' and the `[' is an ordinary character, or -1 if it's
+   something we leave to fnmatch. */
+static int
+hist_glob_bracket (HIST_GLOB_ATOM *a, const char *pat)
+{
+  const char *p, *end;
+  int negate, first, c, cend, i;
+
+  a->op = HIST_GLOB_SET;
+  memset (a->set, 0, sizeof (a->set));
+  p = pat;
+  if (negate = (*p == '!' || *p == '^'))
+    p++;
+  for (first = 1; ; first = 0)
+    {
+      c = (unsigned char)*p++;
+      if (c == '\0')
+	return 0;
+      if (c == ']' && first == 0)
+	break;
+      if (c == '\\')
+	{
+	  if (*p == '\0')
+	    return -1;
+	  c = (unsigned char)*p++;
+	}
+      else if (c == '[' && *p == ':')
+	{
+	  end = strstr (p + 1, ":]");
+	  if (end == 0 || hist_glob_class (a, p + 1, end - p - 1) == 0)
+	    return -1;
+	  p = end + 2;
+	  if (*p == '-' && p[1] != ']')
+	    return -1;
+	  continue;
+	}
+      else if (c == '[' && (*p == '=' || *p == '.'))
+	return -1;
+
+      if (*p == '-' && p[1] != ']' && p[1] != '\0')
+	{
+	  if (hist_glob_rational_ranges () == 0)
+	    return -1;
+	  cend = (unsigned char)p[1];
+	  p += 2;
+	  if (cend == '\\')
+	    {
+	      if (*p == '\0')
+		return -1;
+	      cend = (unsigned char)*p++;
+	    }
+	  else if (cend == '[' && (*p == '.' || *p == '=' || *p == ':'))
+	    return -1;
+	  for (i = c; i <= cend; i++)
+	    HIST_GLOB_ADDSET (a, i);
+	}
+      else
+	HIST_GLOB_ADDSET (a, c);
+    }
+  if (negate)
+    for (i = 0; i < (int)sizeof (a->set); i++)
+      a->set[i] = ~a->set[i];
+  return (p - pat);
+}
+
+/* Compile the glob pattern PAT into G, so lines can be matched against it
+   without calling fnmatch for each one, and find the literal text and
+   minimum length a line needs to match. */
+static void
+hist_glob_compile (HIST_GLOB *g, const char *pat)
+{
+  HIST_GLOB_ATOM *a;
+  const char *p;
+  int c, k, mb, fallback, run, best, bestlen;
+
+  g->atoms = (HIST_GLOB_ATOM *)xmalloc ((strlen (pat) + 1) * sizeof (HIST_GLOB_ATOM));
+  g->natoms = g->minlen = 0;
+  /* In a multibyte locale, `?' and bracket expressions match characters,
+     not bytes. */
+  mb = MB_CUR_MAX > 1;
+  for (fallback = 0, p = pat; *p; )
+    {
+      a = g->atoms + g->natoms;
+      c = (unsigned char)*p++;
+      if (c == '*')
+	{
+	  if (g->natoms == 0 || a[-1].op != HIST_GLOB_STAR)
+	    {
+	      a->op = HIST_GLOB_STAR;
+	      g->natoms++;
+	    }
+	  continue;
+	}
+      else if (c == '?' && mb == 0)
+	a->op = HIST_GLOB_ANY;
+      else if (c == '[' && mb == 0 && (k = hist_glob_bracket (a, p)) != 0)
+	{
+	  if (k < 0)
+	    fallback = 1;
+	  p += k;
+	}
+      else if (c == '?' || (c == '[' && mb))
+	fallback = 1;
+      else if (c == '\\' && *p == '\0')
+	fallback = 1;
+      else
+	{
+	  a->op = HIST_GLOB_CHAR;
+	  a->c = (c == '\\') ? (unsigned char)*p++ : c;
+	}
+      if (fallback)
+	break;
+      g->natoms++;
+      g->minlen++;
+    }
+
+  /* The longest run of ordinary characters, which must appear somewhere
+     in any line that matches. */
+  for (best = bestlen = run = k = 0; k <= g->natoms; k++)
+    if (k < g->natoms && g->atoms[k].op == HIST_GLOB_CHAR)
+      run++;
+    else
+      {
+	if (run > bestlen)
+	  {
+	    best = k - run;
+	    bestlen = run;
+	  }
+	run = 0;
+      }
+  g->litbuf = (char *)xmalloc (bestlen + 1);
+  for (k = 0; k < bestlen; k++)
+    g->litbuf[k] = g->atoms[best + k].c;
+  g->litbuf[bestlen] = '\0';
+  if (bestlen > 0)
+    hist_matcher_init (&g->literal, g->litbuf, bestlen);
+  else
+    g->literal.len = 0;
+
+  if (fallback)
+    {
+      xfree (g->atoms);
+      g->atoms = (HIST_GLOB_ATOM *)NULL;
+    }
+}
+
+static void
+hist_glob_free (HIST_GLOB *g)
+{
+  FREE (g->atoms);
+  FREE (g->litbuf);
+}
+
+/* Return non-zero if all LEN characters of STR match S's pattern. */
+static int
+hist_glob_match (const HIST_SEARCH *s, const char *str, int len)
+{
+  const HIST_GLOB_ATOM *a;
+  const char *q;
+  int na, k, i, star, si, c;
+
+  if (s->glob.atoms == 0)
+    return (fnmatch (s->string, str, 0) == 0);
+
+  a = s->glob.atoms;
+  na = s->glob.natoms;
+  star = -1;
+  for (k = i = si = 0; i < len; )
+    {
+      if (k < na && a[k].op == HIST_GLOB_STAR)
+	{
+	  star = ++k;
+	  si = i;
+	}
+      else if (k < na && ((c = (unsigned char)str[i]), a[k].op == HIST_GLOB_CHAR ? c == a[k].c
+						: (a[k].op == HIST_GLOB_ANY || HIST_GLOB_ISSET (&a[k], c))))
+	{
+	  k++;
+	  i++;
+	  continue;
+	}
+      else if (star < 0)
+	return 0;
+      else
+	{
+	  /* Let the last `*' match one more character and try again. */
+	  k = star;
+	  si++;
+	}
+
+      if (k == na)
+	return 1;		/* a trailing `*' matches the rest */
+      /* Skip to the next place the character after the `*' appears. */
+      if (a[k].op == HIST_GLOB_CHAR)
+	{
+	  q = memchr (str + si, a[k].c, len - si);
+	  if (q == 0)
+	    return 0;
+	  si = q - str;
+	}
+      i = si;
+    }
+  while (k < na && a[k].op == HIST_GLOB_STAR)
+    k++;
+  return (k == na);
+}
+
+/* The pattern search version of hist_search_line: return the offset in
+   LINE, which is LEN characters long, where S's glob pattern matches, or
+   -1.  The results are the same as calling fnmatch at each offset. */
+static int
+hist_glob_search (const HIST_SEARCH *s, const char *line, int len)
+{
+  int lo, hi, mid;
+
+  if (len < s->glob.minlen)
+    return -1;
+  if (s->glob.literal.len && hist_match_forward (&s->glob.literal, line, len) < 0)
+    return -1;
+
+  if (s->anchored == ANCHORED_SEARCH)
+    return (hist_glob_match (s, line, len) ? 0 : -1);
+
+  /* An unanchored pattern starts with `*', so if it matches anywhere in
+     LINE it matches at offset 0.  As before, a line shorter than the
+     pattern isn't tried. */
+  if (s->reverse == 0)
+    return ((len >= s->string_len && hist_glob_match (s, line, len)) ? 0 : -1);
+
+  /* Find the last offset at which the pattern matches.  Because of the
+     leading `*', if it matches at some offset it matches at every offset
+     before that one too, so we can look for the last one by bisection. */
+  if (s->glob.atoms == 0)
+    {
+      for (lo = len - 1; lo >= 0; lo--)
+	if (fnmatch (s->string, line + lo, 0) == 0)
+	  return (lo);
+      return -1;
+    }
+  if (len == 0 || hist_glob_match (s, line, len) == 0)
+    return -1;
+  for (lo = 0, hi = len - 1; lo < hi; )
+    {
+      mid = lo + (hi - lo + 1) / 2;
+      if (hist_glob_match (s, line + mid, len - mid))
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+  return (lo);
+}
+#endif /* HAVE_FNMATCH */
+
+/* Return the mask of HISTORY_CHAR_BITs of the LEN characters at S. */
+static unsigned long
+hist_string_chars (const char *s, size_t len)
+{
+  unsigned long mask;
+  size_t i;
+
+  for (mask = 0, i = 0; i < len; i++)
+    mask |= HISTORY_CHAR_BIT (s[i]);
+  return (mask);
+}
+
+/* Return the offset in LINE, which is LEN characters long, where S's
+   string matches, or -1 if it doesn't.  An anchored match is always at
+   offset 0. */
+static int
+hist_search_line (const HIST_SEARCH *s, const char *line, int len)
+{
+  register int line_index;
+
+  line_index = len;
+
+#if defined (HAVE_FNMATCH)
+  if (s->patsearch)
+    return (hist_glob_search (s, line, line_index));
+#endif
+
+  /* If STRING is longer than line, no match. */
+  if (s->string_len > line_index)
+    return (-1);
+
+  /* Handle anchored searches first. */
+  if (s->anchored == ANCHORED_SEARCH)
+    return (STREQN (s->string, line, s->string_len) ? 0 : -1);
+
+  /* Do substring search. */
+  return (s->reverse ? hist_match_reverse (&s->matcher, line, line_index)
+		     : hist_match_forward (&s->matcher, line, line_index));
+}
+
+/* Like hist_search_line, for the line of LIST[I].  A line that lacks one
+   of the characters S needs is passed over without looking at it. */
+static int
+hist_search_entry (const HIST_SEARCH *s, HIST_ENTRY **list, int i)
+{
+  unsigned long chars;
+  size_t len;
+
+  len = _hs_history_line_info (i, &chars);
+  if ((chars & s->need) != s->need)
+    return (-1);
+  return (hist_search_line (s, list[i]->line, len));
+}
+
+#if defined (HISTORY_USE_PTHREADS)
+static void *
+hist_search_worker (void *arg)
+{
+  HIST_SEARCH_JOB *job;
+  int c, found, k, end, i, r;
+
+  job = (HIST_SEARCH_JOB *)arg;
+  for (;;)
+    {
+      /* Another worker may change job->found as soon as the lock is
+	 released, so test the value we claimed the chunk against. */
+      pthread_mutex_lock (&job->lock);
+      c = job->next;
+      found = job->found;
+      if (c < found)
+	job->next++;
+      pthread_mutex_unlock (&job->lock);
+      if (c >= found || c >= job->nchunks)
+	break;
+
+      end = (c + 1) * job->chunk;
+      if (end > job->nlines)
+	end = job->nlines;
+      for (k = c * job->chunk; k < end; k++)
+	{
+	  i = job->search->reverse ? job->start - k : job->start + k;
+	  r = hist_search_entry (job->search, job->list, i);
+	  if (r >= 0)
+	    {
+	      pthread_mutex_lock (&job->lock);
+	      if (c < job->found)
+		{
+		  job->found = c;
+		  job->line = i;
+		  job->offset = r;
+		}
+	      pthread_mutex_unlock (&job->lock);
+	      break;
+	    }
+	}
+    }
+  return ((void *)NULL);
+}
+
+/* Search the NLINES lines of LIST from START in S's direction using
+   history_search_threads threads, and return the offset of the first
+   match the serial search would find, storing its index in *INDP.
+   Returns -1 if there is no match, and -2 if the threads couldn't be
+   started, in which case the caller searches the lines itself. */
+static int
+hist_search_parallel (const HIST_SEARCH *s, HIST_ENTRY **list, int start, int nlines, int *indp)
+{
+  HIST_SEARCH_JOB job;
+  pthread_t tids[HIST_SEARCH_MAXTHREADS];
+  int nthreads, t;
+
+  nthreads = history_search_threads;
+  if (nthreads > HIST_SEARCH_MAXTHREADS)
+    nthreads = HIST_SEARCH_MAXTHREADS;
+
+  job.search = s;
+  job.list = list;
+  job.start = start;
+  job.nlines = nlines;
+  /* Small enough chunks that the threads share the work evenly and a
+     match near START ends the search quickly. */
+  job.chunk = nlines / (nthreads * 16) + 1;
+  if (job.chunk > HIST_SEARCH_CHUNK)
+    job.chunk = HIST_SEARCH_CHUNK;
+  job.nchunks = (nlines + job.chunk - 1) / job.chunk;
+  job.next = 0;
+  job.found = job.nchunks;
+  job.line = job.offset = -1;
+  if (pthread_mutex_init (&job.lock, NULL) != 0)
+    return -2;
+
+  /* This thread is one of the workers. */
+  for (t = 0; t < nthreads - 1; t++)
+    if (pthread_create (&tids[t], NULL, hist_search_worker, &job) != 0)
+      break;
+  if (t == 0)
+    {
+      pthread_mutex_destroy (&job.lock);
+      return -2;
+    }
+  hist_search_worker (&job);
+  while (t > 0)
+    pthread_join (tids[--t], NULL);
+  pthread_mutex_destroy (&job.lock);
+
+  if (job.found == job.nchunks)
+    return -1;
+  *indp = job.line;
+  return (job.offset);
+}
+#endif /* HISTORY_USE_PTHREADS */
+
 /* Search the history for STRING, starting at history_offset.
    If DIRECTION < 0, then the search is through previous entries, else
    through subsequent.  If ANCHORED is non-zero, the string must
@@ -66,133 +709,103 @@ static int history_search_internal PARAMS((const char *, int, int));
 static int
 history_search_internal (const char *string, int direction, int flags)
 {
-  register int i, reverse;
-  register char *line;
-  register int line_index;
-  int string_len, anchored, patsearch;
+  int i, line_index, lazy;
+#if defined (HISTORY_USE_PTHREADS)
+  int nlines;
+#endif
   HIST_ENTRY **the_history; 	/* local */
+  HIST_SEARCH search;
+  char *line;
+  size_t len;
 
+  _hs_history_sweep ();
   i = history_offset;
-  reverse = (direction < 0);
-  anchored = (flags & ANCHORED_SEARCH);
+  search.reverse = (direction < 0);
+  search.anchored = (flags & ANCHORED_SEARCH);
 #if defined (HAVE_FNMATCH)
-  patsearch = (flags & PATTERN_SEARCH);
+  search.patsearch = (flags & PATTERN_SEARCH);
 #else
-  patsearch = 0;
+  search.patsearch = 0;
 #endif
 
   /* Take care of trivial cases first. */
   if (string == 0 || *string == '\0')
     return (-1);
 
-  if (!history_length || ((i >= history_length) && !reverse))
+  if (!history_length || ((i >= history_length) && !search.reverse))
     return (-1);
 
-  if (reverse && (i >= history_length))
+  if (search.reverse && (i >= history_length))
     i = history_length - 1;
 
-#define NEXT_LINE() do { if (reverse) i--; else i++; } while (0)
-
-  the_history = history_list ();
-  string_len = strlen (string);
-  while (1)
+  /* The first LAZY entries are still in the backlog, and are searched
+     separately, without making them.  Only the one found is made, along
+     with those after it. */
+  the_history = _hs_history_entries ();
+  lazy = _hs_history_lazy_length ();
+  search.string = string;
+  search.string_len = strlen (string);
+  search.need = 0;
+  if (search.patsearch == 0)
+    search.need = hist_string_chars (string, search.string_len);
+  if (search.anchored == 0 && search.patsearch == 0)
+    hist_matcher_init (&search.matcher, string, search.string_len);
+#if defined (HAVE_FNMATCH)
+  if (search.patsearch)
     {
-      /* Search each line in the history list for STRING. */
-
-      /* At limit for direction? */
-      if ((reverse && i < 0) || (!reverse && i == history_length))
-	return (-1);
-
-      line = the_history[i]->line;
-      line_index = strlen (line);
+      hist_glob_compile (&search.glob, string);
+      search.need = hist_string_chars (search.glob.litbuf, search.glob.literal.len);
+    }
+#endif
 
-      /* If STRING is longer than line, no match. */
-      if (patsearch == 0 && (string_len > line_index))
+  line_index = -1;
+  if (search.reverse == 0)
+    for ( ; i < lazy; i++)
+      if ((line = _hs_history_lazy_line (i, &len)) &&
+	  (line_index = hist_search_line (&search, line, len)) >= 0)
 	{
-	  NEXT_LINE ();
-	  continue;
+	  _hs_history_lazy_load (i);
+	  history_offset = i;
+	  break;
 	}
 
-      /* Handle anchored searches first. */
-      if (anchored == ANCHORED_SEARCH)
+  if (line_index < 0 && (search.reverse ? (i >= lazy) : (i < history_length)))
+    {
+#if defined (HISTORY_USE_PTHREADS)
+      /* Lines from I to the end of the list in the search direction. */
+      nlines = search.reverse ? i + 1 - lazy : history_length - i;
+      if (history_search_threads > 1 && nlines >= history_search_threshold &&
+	  (line_index = hist_search_parallel (&search, the_history, i, nlines, &i)) != -2)
 	{
-#if defined (HAVE_FNMATCH)
-	  if (patsearch)
-	    {
-	      if (fnmatch (string, line, 0) == 0)
-		{
-		  history_offset = i;
-		  return (0);
-		}
-	    }
-	  else
-#endif
-	  if (STREQN (string, line, string_len))
-	    {
-	      history_offset = i;
-	      return (0);
-	    }
-
-	  NEXT_LINE ();
-	  continue;
+	  if (line_index >= 0)
+	    history_offset = i;
 	}
+      else
+#endif
+      /* Search each line in the history list for STRING. */
+      for (line_index = -1; search.reverse ? (i >= lazy) : (i < history_length); search.reverse ? i-- : i++)
+	if ((line_index = hist_search_entry (&search, the_history, i)) >= 0)
+	  {
+	    history_offset = i;
+	    break;
+	  }
+    }
 
-      /* Do substring search. */
-      if (reverse)
+  if (line_index < 0 && search.reverse)
+    for (i = (i < lazy) ? i : lazy - 1; i >= 0; i--)
+      if ((line = _hs_history_lazy_line (i, &len)) &&
+	  (line_index = hist_search_line (&search, line, len)) >= 0)
 	{
-	  line_index -= (patsearch == 0) ? string_len : 1;
-
-	  while (line_index >= 0)
-	    {
-#if defined (HAVE_FNMATCH)
-	      if (patsearch)
-		{
-		  if (fnmatch (string, line + line_index, 0) == 0)
-		    {
-		      history_offset = i;
-		      return (line_index);
-		    }
-		}
-	      else
-#endif
-	      if (STREQN (string, line + line_index, string_len))
-		{
-		  history_offset = i;
-		  return (line_index);
-		}
-	      line_index--;
-	    }
+	  _hs_history_lazy_load (i);
+	  history_offset = i;
+	  break;
 	}
-      else
-	{
-	  register int limit;
 
-	  limit = line_index - string_len + 1;
-	  line_index = 0;
-
-	  while (line_index < limit)
-	    {
 #if defined (HAVE_FNMATCH)
-	      if (patsearch)
-		{
-		  if (fnmatch (string, line + line_index, 0) == 0)
-		    {
-		      history_offset = i;
-		      return (line_index);
-		    }
-		}
-	      else
+  if (search.patsearch)
+    hist_glob_free (&search.glob);
 #endif
-	      if (STREQN (string, line + line_index, string_len))
-		{
-		  history_offset = i;
-		  return (line_index);
-		}
-	      line_index++;
-	    }
-	}
-      NEXT_LINE ();
-    }
+  return (line_index);
 }
 
 int
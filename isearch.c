@@ -50,6 +50,7 @@
 
 #include "readline.h"
 #include "history.h"
+#include "histlib.h"
 
 #include "rlprivate.h"
 #include "xmalloc.h"
@@ -59,12 +60,73 @@ char *_rl_isearch_terminators = (char *)NULL;
 
 _rl_search_cxt *_rl_iscxt = 0;
 
+/* Non-zero if line I of the lines being searched is one of the history
+   entries history_lazy_read hasn't made yet.  Its text is only good until
+   the next line is read. */
+#define ISEARCH_BACKLOG(cxt, i) \
+  ((i) < (cxt)->hlen - 1 && (i) < _hs_history_lazy_length ())
+
 /* Variables imported from other files in the readline library. */
 extern HIST_ENTRY *_rl_saved_line_for_history;
 
-static int rl_search_history PARAMS((int, int));
-
-static _rl_search_cxt *_rl_isearch_init PARAMS((int));
+/* A character of a fuzzy search string.  If FOLD is non-zero, it's a
+   lowercase letter that also matches its uppercase form. */
+typedef struct __rl_fuzzy_char
+{
+  const char *s;
+  int len;
+  int fold;
+} _rl_fuzzy_char;
+
+/* Scores for fuzzy search: each character matched earns
+   FUZZY_SCORE_MATCH plus a bonus if it begins a word or follows the
+   previous character matched, and each gap between matched characters
+   costs a penalty that grows with its length.  The bonus for the first
+   character counts FUZZY_BONUS_FIRST times, and lines earn up to
+   FUZZY_BONUS_RECENT points for being recent. */
+#define FUZZY_SCORE_MATCH	16
+#define FUZZY_BONUS_BOUNDARY	8
+#define FUZZY_BONUS_CAMEL	7
+#define FUZZY_BONUS_CONSECUTIVE	4
+#define FUZZY_BONUS_FIRST	2
+#define FUZZY_PENALTY_GAP_START	3
+#define FUZZY_PENALTY_GAP	1
+#define FUZZY_BONUS_RECENT	8
+
+/* The number of matches fuzzy search ranks, and the number of lines it
+   scores before checking for input and showing the best so far. */
+#define FUZZY_MAX_MATCHES	64
+#define FUZZY_CHUNK		4096
+
+#define FUZZY_BETTER(a, b) \
+  ((a)->score > (b)->score || ((a)->score == (b)->score && (a)->line > (b)->line))
+
+static int rl_search_history PARAMS((int, int, int));
+
+static char *_rl_isearch_line PARAMS((_rl_search_cxt *, int, size_t *));
+static int _rl_isearch_matches PARAMS((_rl_search_cxt *, int));
+static char *_rl_isearch_copy PARAMS((char **, size_t *, const char *, size_t));
+static void _rl_isearch_set_sline PARAMS((_rl_search_cxt *, int));
+static char *_rl_isearch_found_line PARAMS((_rl_search_cxt *, int));
+static int _rl_isearch_same_line PARAMS((_rl_search_cxt *, int, int));
+static _rl_search_cxt *_rl_isearch_init PARAMS((int, int));
+static _rl_search_set *_rl_sset_alloc PARAMS((int, int, int));
+static void _rl_sset_add PARAMS((_rl_search_set *, int, int));
+static void _rl_isearch_narrow PARAMS((_rl_search_cxt *));
+static int _rl_isearch_candidate PARAMS((_rl_search_cxt *, int));
+static void _rl_isearch_failed PARAMS((_rl_search_cxt *, int));
+static int _rl_isearch_next_line PARAMS((_rl_search_cxt *));
+
+static int _rl_fuzzy_chars PARAMS((_rl_search_cxt *, _rl_fuzzy_char *));
+static int _rl_fuzzy_next PARAMS((const char *, int, int, _rl_fuzzy_char *));
+static int _rl_fuzzy_prev PARAMS((const char *, int, _rl_fuzzy_char *));
+static int _rl_fuzzy_score PARAMS((const char *, int, _rl_fuzzy_char *, int, _rl_fuzzy_match *));
+static void _rl_fuzzy_insert PARAMS((_rl_search_cxt *, _rl_fuzzy_match *));
+static int _rl_fuzzy_compare PARAMS((const void *, const void *));
+static _rl_fuzzy_match *_rl_fuzzy_best PARAMS((_rl_search_cxt *));
+static void _rl_fuzzy_show PARAMS((_rl_search_cxt *, _rl_fuzzy_match *));
+static int _rl_fuzzy_scan PARAMS((_rl_search_cxt *, int));
+static int _rl_fuzzy_search PARAMS((_rl_search_cxt *));
 static void _rl_isearch_fini PARAMS((_rl_search_cxt *));
 
 /* Last line found by the current incremental search, so we don't `find'
@@ -90,16 +152,27 @@ _rl_scxt_alloc (int type, int flags)
   cxt->search_string = 0;
   cxt->search_string_size = cxt->search_string_index = 0;
 
-  cxt->lines = 0;
+  cxt->hfirst = 0;
+  cxt->input_line = 0;
   cxt->allocated_line = 0;
   cxt->hlen = cxt->hindex = 0;
 
+  cxt->matches = 0;
+
+  cxt->fuzzy = 0;
+  cxt->nfuzzy = cxt->fuzzy_index = 0;
+  cxt->fuzzy_scan = -1;
+  cxt->fuzzy_string = 0;
+
   cxt->save_point = rl_point;
   cxt->save_mark = rl_mark;
   cxt->save_line = where_history ();
   cxt->last_found_line = cxt->save_line;
   cxt->prev_line_found = 0;
 
+  cxt->sline_copy = cxt->found_copy = 0;
+  cxt->sline_copy_size = cxt->found_copy_size = 0;
+
   cxt->save_undo_list = 0;
 
   cxt->keymap = _rl_keymap;
@@ -121,9 +194,22 @@ _rl_scxt_alloc (int type, int flags)
 void
 _rl_scxt_dispose (_rl_search_cxt *cxt, int flags)
 {
+  _rl_search_set *set;
+
+  while (set = cxt->matches)
+    {
+      cxt->matches = set->next;
+      xfree (set->lines);
+      xfree (set);
+    }
+
+  FREE (cxt->fuzzy);
+  FREE (cxt->fuzzy_string);
+
   FREE (cxt->search_string);
   FREE (cxt->allocated_line);
-  FREE (cxt->lines);
+  FREE (cxt->sline_copy);
+  FREE (cxt->found_copy);
 
   xfree (cxt);
 }
@@ -133,7 +219,7 @@ _rl_scxt_dispose (_rl_search_cxt *cxt, int flags)
 int
 rl_reverse_search_history (int sign, int key)
 {
-  return (rl_search_history (-sign, key));
+  return (rl_search_history (-sign, key, 0));
 }
 
 /* Search forwards through the history looking for a string which is typed
@@ -141,7 +227,15 @@ rl_reverse_search_history (int sign, int key)
 int
 rl_forward_search_history (int sign, int key)
 {
-  return (rl_search_history (sign, key));
+  return (rl_search_history (sign, key, 0));
+}
+
+/* Search the history for lines containing the characters typed so far in
+   order, showing the best match first. */
+int
+rl_fuzzy_search_history (int sign, int key)
+{
+  return (rl_search_history (-1, key, SF_FUZZY));
 }
 
 /* Display the current state of the search in the echo-area.
@@ -176,14 +270,22 @@ rl_display_search (char *search_string, int flags, int where)
       msglen += 7;
     }
 
-  if (flags & SF_REVERSE)
+  if (flags & SF_FUZZY)
     {
-      strcpy (message + msglen, "reverse-");
-      msglen += 8;
+      strcpy (message + msglen, "fuzzy-search)`");
+      msglen += 14;
     }
+  else
+    {
+      if (flags & SF_REVERSE)
+	{
+	  strcpy (message + msglen, "reverse-");
+	  msglen += 8;
+	}
 
-  strcpy (message + msglen, "i-search)`");
-  msglen += 10;
+      strcpy (message + msglen, "i-search)`");
+      msglen += 10;
+    }
 
   if (search_string && *search_string)
     {
@@ -200,41 +302,123 @@ rl_display_search (char *search_string, int flags, int where)
   (*rl_redisplay_function) ();
 }
 
+/* Return the text of line I of the lines being searched: the history
+   entries, oldest first, then the current input line.  Leave its length,
+   which the history library keeps for its entries, in *LENP. */
+static char *
+_rl_isearch_line (_rl_search_cxt *cxt, int i, size_t *lenp)
+{
+  if (i < cxt->hlen - 1)
+    return (_hs_history_get_line (cxt->hfirst + i, lenp));
+  *lenp = strlen (cxt->input_line);
+  return (cxt->input_line);
+}
+
+/* Return non-zero if line I contains the search string. */
+static int
+_rl_isearch_matches (_rl_search_cxt *cxt, int i)
+{
+  char *line;
+  size_t len;
+
+  line = _rl_isearch_line (cxt, i, &len);
+  return (len >= cxt->search_string_index && strstr (line, cxt->search_string) != 0);
+}
+
+/* Copy the LEN bytes of LINE and the NUL after them to *BUFP, which is
+   *SIZEP bytes long, making it bigger if it has to be. */
+static char *
+_rl_isearch_copy (char **bufp, size_t *sizep, const char *line, size_t len)
+{
+  if (*sizep < len + 1)
+    {
+      *sizep = len + 1;
+      *bufp = (char *)xrealloc (*bufp, *sizep);
+    }
+  memcpy (*bufp, line, len + 1);
+  return (*bufp);
+}
+
+/* Make line I the one CXT->sline_index moves through.  A line that isn't
+   a history entry yet is copied rather than made into one, so the search
+   can go on reading lines past it. */
+static void
+_rl_isearch_set_sline (_rl_search_cxt *cxt, int i)
+{
+  char *line;
+  size_t len;
+
+  line = _rl_isearch_line (cxt, i, &len);
+  if (ISEARCH_BACKLOG (cxt, i))
+    line = _rl_isearch_copy (&cxt->sline_copy, &cxt->sline_copy_size, line, len);
+  cxt->sline = line;
+  cxt->sline_len = len;
+}
+
+/* Return the text of line I, found by the search, in a form that lasts
+   until the next line is found. */
+static char *
+_rl_isearch_found_line (_rl_search_cxt *cxt, int i)
+{
+  char *line;
+  size_t len;
+
+  line = _rl_isearch_line (cxt, i, &len);
+  if (ISEARCH_BACKLOG (cxt, i))
+    line = _rl_isearch_copy (&cxt->found_copy, &cxt->found_copy_size, line, len);
+  return line;
+}
+
+/* Return non-zero if lines I and J have the same text. */
+static int
+_rl_isearch_same_line (_rl_search_cxt *cxt, int i, int j)
+{
+  char *s, *t;
+  size_t slen, tlen;
+  int r;
+
+  s = _rl_isearch_line (cxt, i, &slen);
+  if (ISEARCH_BACKLOG (cxt, i) && ISEARCH_BACKLOG (cxt, j))
+    {
+      s = savestring (s);
+      t = _rl_isearch_line (cxt, j, &tlen);
+      r = slen == tlen && memcmp (s, t, slen) == 0;
+      xfree (s);
+      return r;
+    }
+  t = _rl_isearch_line (cxt, j, &tlen);
+  return (slen == tlen && memcmp (s, t, slen) == 0);
+}
+
 static _rl_search_cxt *
-_rl_isearch_init (int direction)
+_rl_isearch_init (int direction, int flags)
 {
   _rl_search_cxt *cxt;
-  register int i;
-  HIST_ENTRY **hlist;
 
-  cxt = _rl_scxt_alloc (RL_SEARCH_ISEARCH, 0);
+  _rl_history_share_sync ();
+  cxt = _rl_scxt_alloc (RL_SEARCH_ISEARCH, flags);
   if (direction < 0)
     cxt->sflags |= SF_REVERSE;
 
   cxt->search_terminators = _rl_isearch_terminators ? _rl_isearch_terminators
 						: default_isearch_terminators;
 
-  /* Create an array of pointers to the lines that we want to search. */
-  hlist = history_list ();
+  /* Search the history list in place, followed by the current input
+     line, rather than copying the lines.  The entries history_lazy_read
+     hasn't made yet come first, and are read without making them. */
   rl_maybe_replace_line ();
-  i = 0;
-  if (hlist)
-    for (i = 0; hlist[i]; i++);
-
-  /* Allocate space for this many lines, +1 for the current input line,
-     and remember those lines. */
-  cxt->lines = (char **)xmalloc ((1 + (cxt->hlen = i)) * sizeof (char *));
-  for (i = 0; i < cxt->hlen; i++)
-    cxt->lines[i] = hlist[i]->line;
+  _hs_history_sweep ();
+  cxt->hfirst = history_base;
+  cxt->hlen = history_length;
 
   if (_rl_saved_line_for_history)
-    cxt->lines[i] = _rl_saved_line_for_history->line;
+    cxt->input_line = _rl_saved_line_for_history->line;
   else
     {
       /* Keep track of this so we can free it. */
       cxt->allocated_line = (char *)xmalloc (1 + strlen (rl_line_buffer));
       strcpy (cxt->allocated_line, &rl_line_buffer[0]);
-      cxt->lines[i] = cxt->allocated_line;
+      cxt->input_line = cxt->allocated_line;
     }
 
   cxt->hlen++;
@@ -252,7 +436,7 @@ _rl_isearch_init (int direction)
   cxt->direction = (direction >= 0) ? 1 : -1;
 
   cxt->sline = rl_line_buffer;
-  cxt->sline_len = strlen (cxt->sline);
+  cxt->sline_len = rl_end;
   cxt->sline_index = rl_point;
 
   _rl_iscxt = cxt;		/* save globally */
@@ -266,8 +450,10 @@ _rl_isearch_init (int direction)
 static void
 _rl_isearch_fini (_rl_search_cxt *cxt)
 {
+  size_t len;
+
   /* First put back the original state. */
-  rl_replace_line (cxt->lines[cxt->save_line], 0);
+  rl_replace_line (_rl_isearch_line (cxt, cxt->save_line, &len), 0);
 
   rl_restore_prompt ();
 
@@ -277,10 +463,12 @@ _rl_isearch_fini (_rl_search_cxt *cxt)
   last_isearch_string_len = cxt->search_string_index;
   cxt->search_string = 0;
 
+  /* _rl_isearch_init looked for shared lines, and the line numbers are
+     relative to the history list as it was then, so don't look again. */
   if (cxt->last_found_line < cxt->save_line)
-    rl_get_previous_history (cxt->save_line - cxt->last_found_line, 0);
+    _rl_get_previous_history (cxt->save_line - cxt->last_found_line);
   else
-    rl_get_next_history (cxt->last_found_line - cxt->save_line, 0);
+    _rl_get_next_history (cxt->last_found_line - cxt->save_line);
 
   /* If the string was not found, put point at the end of the last matching
      line.  If last_found_line == orig_line, we didn't find any matching
@@ -296,8 +484,8 @@ _rl_isearch_fini (_rl_search_cxt *cxt)
     }
 
   rl_point = cxt->sline_index;
-  /* Don't worry about where to put the mark here; rl_get_previous_history
-     and rl_get_next_history take care of it.
+  /* Don't worry about where to put the mark here; _rl_get_previous_history
+     and _rl_get_next_history take care of it.
      If we want to highlight the search string, this is where to set the
      point and mark to do it. */
   _rl_fix_point (0);
@@ -307,6 +495,532 @@ _rl_isearch_fini (_rl_search_cxt *cxt)
   rl_clear_message ();
 }
 
+static _rl_search_set *
+_rl_sset_alloc (int len, int lo, int hi)
+{
+  _rl_search_set *set;
+
+  set = (_rl_search_set *)xmalloc (sizeof (_rl_search_set));
+  set->next = 0;
+  set->len = len;
+  set->lo = lo;
+  set->hi = hi;
+  set->size = 16;
+  set->lines = (int *)xmalloc (set->size * sizeof (int));
+  set->first = set->last = set->size / 2;
+  return set;
+}
+
+/* Add LINE to SET.  Lines are only added past the ends of the range SET
+   covers, so LINE goes at the end if DIRECTION is positive and at the
+   start otherwise. */
+static void
+_rl_sset_add (_rl_search_set *set, int line, int direction)
+{
+  int n, first;
+
+  if ((direction > 0) ? (set->last == set->size) : (set->first == 0))
+    {
+      /* Grow the array, leaving the lines in the middle. */
+      n = set->last - set->first;
+      set->size = 2 * set->size + 2 * n;
+      first = (set->size - n) / 2;
+      memmove (set->lines, set->lines + set->first, n * sizeof (int));
+      set->lines = (int *)xrealloc (set->lines, set->size * sizeof (int));
+      memmove (set->lines + first, set->lines, n * sizeof (int));
+      set->first = first;
+      set->last = first + n;
+    }
+  if (direction > 0)
+    set->lines[set->last++] = line;
+  else
+    set->lines[--set->first] = line;
+}
+
+/* Make CXT->matches describe the current search string.  Sets for longer
+   strings are left over from before a rubout and are thrown away.  When
+   the string has grown, every line that matches it also matched the
+   shorter string, so the new set is made by checking only the lines in
+   the last one. */
+static void
+_rl_isearch_narrow (_rl_search_cxt *cxt)
+{
+  _rl_search_set *set, *new;
+  int k;
+
+  while ((set = cxt->matches) && set->len > cxt->search_string_index)
+    {
+      cxt->matches = set->next;
+      xfree (set->lines);
+      xfree (set);
+    }
+
+  if (cxt->search_string_index == 0 || (set && set->len == cxt->search_string_index))
+    return;
+
+  if (set)
+    {
+      new = _rl_sset_alloc (cxt->search_string_index, set->lo, set->hi);
+      for (k = set->first; k < set->last; k++)
+	if (_rl_isearch_matches (cxt, set->lines[k]))
+	  _rl_sset_add (new, set->lines[k], 1);
+    }
+  else
+    {
+      k = (cxt->direction > 0) ? cxt->history_pos + 1 : cxt->history_pos;
+      new = _rl_sset_alloc (cxt->search_string_index, k, k);
+    }
+  new->next = set;
+  cxt->matches = new;
+}
+
+/* Return the first line at or past NEXT, in the search direction, that
+   might contain the search string.  The history library's trigram
+   index, if it's enabled, lets us skip the history entries that can't.
+   The current input line, searched last, isn't in the history and
+   is never skipped. */
+static int
+_rl_isearch_candidate (_rl_search_cxt *cxt, int next)
+{
+  int hpos, nlazy;
+
+  /* Neither are the entries history_lazy_read hasn't made yet. */
+  nlazy = _hs_history_lazy_length ();
+  if (next >= cxt->hlen - 1 || next < nlazy)
+    return next;
+
+  hpos = history_search_candidate (cxt->search_string, cxt->search_string_index,
+				   next - cxt->direction, cxt->direction);
+  if (hpos == -2)
+    return next;
+  else if (hpos >= 0)
+    return hpos;
+  else
+    return ((cxt->direction < 0) ? nlazy - 1 : cxt->hlen - 1);
+}
+
+/* The search from line POS has failed without looking at the lines past
+   it.  Leave CXT->sline and CXT->sline_index as a line-by-line scan would
+   have, since the next search character resumes from them: the line at
+   the end of the list, and the position a forward search reached in the
+   last line it searched. */
+static void
+_rl_isearch_failed (_rl_search_cxt *cxt, int pos)
+{
+  char *line;
+  size_t len;
+  int k;
+
+  k = (cxt->direction > 0) ? cxt->hlen - 1 : 0;
+  if (k == pos)
+    return;
+  _rl_isearch_set_sline (cxt, k);
+
+  if (cxt->direction < 0)
+    return;
+  for ( ; k > pos; k--)
+    {
+      line = _rl_isearch_line (cxt, k, &len);
+      if (len >= cxt->search_string_index &&
+	  (cxt->prev_line_found == 0 || STREQ (cxt->prev_line_found, line) == 0))
+	{
+	  cxt->sline_index = len - cxt->search_string_index + 1;
+	  break;
+	}
+    }
+}
+
+/* Return the index of the next line past CXT->history_pos,
+   in the search direction, that contains the search string, or -1 or
+   CXT->hlen if there isn't one.  Lines the current match set covers
+   aren't checked again; lines past it are checked and added to it. */
+static int
+_rl_isearch_next_line (_rl_search_cxt *cxt)
+{
+  _rl_search_set *set;
+  int pos, next, lo, hi, mid;
+
+  pos = cxt->history_pos;
+  next = pos + cxt->direction;
+  set = cxt->matches;
+  if (next < 0 || next >= cxt->hlen || set == 0)
+    return next;
+
+  /* The set has to cover the lines next to POS.  If it doesn't, which
+     can happen after a rubout, start it over from POS. */
+  if (pos < set->lo - 1 || pos > set->hi)
+    {
+      set->first = set->last = set->size / 2;
+      set->lo = set->hi = (cxt->direction > 0) ? pos + 1 : pos;
+    }
+
+  /* Find the first known match past POS. */
+  lo = set->first;
+  hi = set->last;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (set->lines[mid] <= pos)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  if (cxt->direction > 0 && lo < set->last)
+    return (set->lines[lo]);
+  /* Otherwise find the last one before it. */
+  while (lo > set->first && set->lines[lo - 1] >= pos)
+    lo--;
+  if (cxt->direction < 0 && lo > set->first)
+    return (set->lines[lo - 1]);
+
+  /* Check the lines past the end of the set, adding them to it. */
+  for (next = (cxt->direction > 0) ? set->hi : set->lo - 1; ; next += cxt->direction)
+    {
+      if (next >= 0 && next < cxt->hlen)
+	next = _rl_isearch_candidate (cxt, next);
+      if (next < 0 || next >= cxt->hlen)
+	{
+	  if (cxt->direction > 0)
+	    set->hi = cxt->hlen;
+	  else
+	    set->lo = 0;
+	  _rl_isearch_failed (cxt, pos);
+	  return ((cxt->direction > 0) ? cxt->hlen : -1);
+	}
+      if (cxt->direction > 0)
+	set->hi = next + 1;
+      else
+	set->lo = next;
+      if (_rl_isearch_matches (cxt, next))
+	{
+	  _rl_sset_add (set, next, cxt->direction);
+	  if ((cxt->direction > 0) ? (next > pos) : (next < pos))
+	    return next;
+	}
+    }
+}
+
+/* Split the search string into the characters a fuzzy search looks for,
+   returning how many there are.  Lowercase letters match either case
+   unless the string contains an uppercase letter. */
+static int
+_rl_fuzzy_chars (_rl_search_cxt *cxt, _rl_fuzzy_char *chars)
+{
+  int i, n, fold;
+
+  for (i = 0, fold = 1; i < cxt->search_string_index; i++)
+    if (_rl_uppercase_p ((unsigned char)cxt->search_string[i]))
+      fold = 0;
+
+  for (i = n = 0; i < cxt->search_string_index; n++)
+    {
+      chars[n].s = cxt->search_string + i;
+#if defined (HANDLE_MULTIBYTE)
+      if (MB_CUR_MAX > 1 && rl_byte_oriented == 0)
+	chars[n].len = _rl_find_next_mbchar (cxt->search_string, i, 1, MB_FIND_NONZERO) - i;
+      else
+#endif
+	chars[n].len = 1;
+      if (chars[n].len <= 0)
+	chars[n].len = 1;
+      chars[n].fold = fold && chars[n].len == 1 && _rl_lowercase_p ((unsigned char)chars[n].s[0]);
+      i += chars[n].len;
+    }
+  return n;
+}
+
+/* Return the index of the first occurrence of C in LINE at or after POS
+   and ending by END, or -1 if there isn't one.  This is where a fuzzy
+   search spends its time, so it leaves the scanning to memchr and
+   strcspn. */
+static int
+_rl_fuzzy_next (const char *line, int pos, int end, _rl_fuzzy_char *c)
+{
+  const char *p;
+  char set[3];
+
+  if (c->fold)
+    {
+      set[0] = c->s[0];
+      set[1] = _rl_to_upper ((unsigned char)c->s[0]);
+      set[2] = '\0';
+      pos += strcspn (line + pos, set);
+      return ((pos < end) ? pos : -1);
+    }
+
+  for (p = line + pos; p = memchr (p, c->s[0], end - (p - line)); p++)
+    if (p + c->len <= line + end && (c->len == 1 || memcmp (p, c->s, c->len) == 0))
+      return (p - line);
+  return -1;
+}
+
+/* Return the index of the last occurrence of C in LINE that ends by END,
+   or -1 if there isn't one. */
+static int
+_rl_fuzzy_prev (const char *line, int end, _rl_fuzzy_char *c)
+{
+  int i;
+
+  for (i = end - c->len; i >= 0; i--)
+    if (c->fold ? (_rl_to_lower ((unsigned char)line[i]) == c->s[0])
+		: (line[i] == c->s[0] && (c->len == 1 || memcmp (line + i, c->s, c->len) == 0)))
+      return i;
+  return -1;
+}
+
+/* Score the match of the N characters in CHARS in LINE, LEN bytes long,
+   filling in M.  Returns 0 if they don't all appear in order.  The
+   characters are first found as early as possible, then the match is
+   narrowed from the right to the shortest one ending in the same place,
+   so lines aren't penalized for stray earlier occurrences of the first
+   characters. */
+static int
+_rl_fuzzy_score (const char *line, int len, _rl_fuzzy_char *chars, int n, _rl_fuzzy_match *m)
+{
+  int i, k, pos, prev, bonus;
+  unsigned char c, pc;
+
+  for (i = pos = 0; i < n; i++)
+    {
+      if ((k = _rl_fuzzy_next (line, pos, len, chars + i)) < 0)
+	return 0;
+      pos = k + chars[i].len;
+    }
+  m->end = pos;
+
+  for (i = n - 1; i >= 0; i--)
+    pos = _rl_fuzzy_prev (line, pos, chars + i);
+  m->start = pos;
+
+  m->score = 0;
+  for (i = 0, prev = -1; i < n; i++)
+    {
+      k = _rl_fuzzy_next (line, pos, m->end, chars + i);
+      c = line[k];
+      pc = k ? line[k - 1] : ' ';
+      if (k == 0 || whitespace (pc) || strchr ("/\\-_.:=,;|&'\"([{@", pc))
+	bonus = FUZZY_BONUS_BOUNDARY;
+      else if (_rl_lowercase_p (pc) && _rl_uppercase_p (c))
+	bonus = FUZZY_BONUS_CAMEL;
+      else
+	bonus = 0;
+
+      if (prev == k)
+	bonus = (bonus > FUZZY_BONUS_CONSECUTIVE) ? bonus : FUZZY_BONUS_CONSECUTIVE;
+      else if (prev >= 0)
+	m->score -= FUZZY_PENALTY_GAP_START + (k - prev - 1) * FUZZY_PENALTY_GAP;
+
+      m->score += FUZZY_SCORE_MATCH + ((i == 0) ? bonus * FUZZY_BONUS_FIRST : bonus);
+      pos = prev = k + chars[i].len;
+    }
+  return 1;
+}
+
+/* Add M to the matches CXT->fuzzy is keeping, unless they already include
+   a better match for the same text.  While the lines are being scored,
+   the matches are kept in a heap with the worst at the top, so a line
+   that isn't among the best so far is turned away with one comparison. */
+static void
+_rl_fuzzy_insert (_rl_search_cxt *cxt, _rl_fuzzy_match *m)
+{
+  _rl_fuzzy_match *h;
+  int i, j;
+
+  h = cxt->fuzzy;
+  if (cxt->nfuzzy == FUZZY_MAX_MATCHES && FUZZY_BETTER (h, m))
+    return;
+
+  /* Entries for the same line always match the same way. */
+  for (i = 0; i < cxt->nfuzzy; i++)
+    if (h[i].start == m->start && h[i].end == m->end &&
+	_rl_isearch_same_line (cxt, h[i].line, m->line))
+      return;
+
+  if (cxt->nfuzzy < FUZZY_MAX_MATCHES)
+    {
+      /* Add it at the bottom and move it up. */
+      for (i = cxt->nfuzzy++; i > 0 && FUZZY_BETTER (h + (i - 1) / 2, m); i = (i - 1) / 2)
+	h[i] = h[(i - 1) / 2];
+      h[i] = *m;
+      return;
+    }
+
+  /* Replace the worst and move it down. */
+  for (i = 0; (j = 2 * i + 1) < cxt->nfuzzy; i = j)
+    {
+      if (j + 1 < cxt->nfuzzy && FUZZY_BETTER (h + j, h + j + 1))
+	j++;
+      if (FUZZY_BETTER (m, h + j) == 0)
+	break;
+      h[i] = h[j];
+    }
+  h[i] = *m;
+}
+
+/* Sort fuzzy matches best first. */
+static int
+_rl_fuzzy_compare (const void *a, const void *b)
+{
+  if (FUZZY_BETTER ((const _rl_fuzzy_match *)a, (const _rl_fuzzy_match *)b))
+    return -1;
+  else if (FUZZY_BETTER ((const _rl_fuzzy_match *)b, (const _rl_fuzzy_match *)a))
+    return 1;
+  return 0;
+}
+
+/* Return the best fuzzy match found so far, or NULL if there aren't any. */
+static _rl_fuzzy_match *
+_rl_fuzzy_best (_rl_search_cxt *cxt)
+{
+  _rl_fuzzy_match *best;
+  int i;
+
+  if (cxt->fuzzy_scan < 0)
+    return (cxt->nfuzzy ? cxt->fuzzy + cxt->fuzzy_index : 0);
+  for (i = 0, best = 0; i < cxt->nfuzzy; i++)
+    if (best == 0 || FUZZY_BETTER (cxt->fuzzy + i, best))
+      best = cxt->fuzzy + i;
+  return best;
+}
+
+/* Show fuzzy match M, or that there aren't any if M is NULL. */
+static void
+_rl_fuzzy_show (_rl_search_cxt *cxt, _rl_fuzzy_match *m)
+{
+  cxt->sflags &= ~(SF_FOUND|SF_FAILED);
+  if (m == 0)
+    {
+      cxt->sflags |= SF_FAILED;
+      rl_ding ();
+      cxt->history_pos = cxt->last_found_line;
+      rl_deactivate_mark ();
+      rl_display_search (cxt->search_string, cxt->sflags, -1);
+      return;
+    }
+
+  cxt->sflags |= SF_FOUND;
+  cxt->history_pos = cxt->last_found_line = m->line;
+  _rl_isearch_set_sline (cxt, m->line);
+  cxt->sline_index = m->start;
+  cxt->prev_line_found = _rl_isearch_found_line (cxt, m->line);
+  rl_replace_line (cxt->sline, 0);
+  if (_rl_enable_active_region)
+    rl_activate_mark ();
+  rl_point = m->start;
+  if (rl_mark_active_p ())
+    rl_mark = m->end;
+  rl_display_search (cxt->search_string, cxt->sflags, m->line);
+}
+
+/* Score the history lines from CXT->fuzzy_scan back to the oldest.  Every
+   FUZZY_CHUNK lines, show the best match so far if it has changed, and,
+   if INTERRUPT is non-zero and the user has typed something, stop and
+   return 0 so the next character can be handled.  Once all the lines are
+   scored, sort the matches and return 1. */
+static int
+_rl_fuzzy_scan (_rl_search_cxt *cxt, int interrupt)
+{
+  _rl_fuzzy_char *chars;
+  _rl_fuzzy_match m, *best, shown;
+  const char *line;
+  unsigned long need;
+  size_t len, minlen;
+  int n, i, stop;
+
+  if (cxt->fuzzy_scan >= 0)
+    {
+      if (cxt->fuzzy == 0)
+	cxt->fuzzy = (_rl_fuzzy_match *)xmalloc (FUZZY_MAX_MATCHES * sizeof (_rl_fuzzy_match));
+      chars = (_rl_fuzzy_char *)xmalloc ((cxt->search_string_index + 1) * sizeof (_rl_fuzzy_char));
+      n = _rl_fuzzy_chars (cxt, chars);
+      shown.line = -1;
+
+      /* A line can't match unless it has each of the characters and is
+	 long enough to hold them; the history library keeps enough about
+	 each line to tell without looking at it. */
+      for (need = 0, minlen = 0, i = 0; i < n; i++)
+	{
+	  if (chars[i].fold == 0 || (chars[i].s[0] >= 'a' && chars[i].s[0] <= 'z'))
+	    need |= HISTORY_CHAR_BIT (chars[i].s[0]);
+	  minlen += chars[i].len;
+	}
+
+      while (cxt->fuzzy_scan >= 0)
+	{
+	  stop = cxt->fuzzy_scan - FUZZY_CHUNK;
+	  for ( ; cxt->fuzzy_scan >= 0 && cxt->fuzzy_scan > stop; cxt->fuzzy_scan--)
+	    {
+	      if ((_hs_history_line_chars (cxt->hfirst + cxt->fuzzy_scan) & need) != need)
+		continue;
+	      line = _rl_isearch_line (cxt, cxt->fuzzy_scan, &len);
+	      if (len >= minlen && _rl_fuzzy_score (line, len, chars, n, &m))
+		{
+		  m.line = cxt->fuzzy_scan;
+		  m.score += FUZZY_BONUS_RECENT * (m.line + 1) / (cxt->hlen - 1);
+		  _rl_fuzzy_insert (cxt, &m);
+		}
+	    }
+	  if (cxt->fuzzy_scan < 0)
+	    break;
+
+	  /* Show what we have while the scan goes on. */
+	  if ((best = _rl_fuzzy_best (cxt)) && best->line != shown.line)
+	    {
+	      shown = *best;
+	      _rl_fuzzy_show (cxt, &shown);
+	    }
+	  if (interrupt && (_rl_pushed_input_available () || _rl_input_queued (0)))
+	    {
+	      xfree (chars);
+	      return 0;
+	    }
+	}
+      xfree (chars);
+
+      qsort (cxt->fuzzy, cxt->nfuzzy, sizeof (_rl_fuzzy_match), _rl_fuzzy_compare);
+      cxt->fuzzy_index = 0;
+    }
+  return 1;
+}
+
+/* Do a fuzzy search after the search string has changed or the user has
+   asked for another match: the reverse search key moves to the next best
+   match, and the forward search key back to the one before it. */
+static int
+_rl_fuzzy_search (_rl_search_cxt *cxt)
+{
+  int next;
+
+  next = (cxt->lastc == -1) ? 1 : ((cxt->lastc == -2) ? -1 : 0);
+  if (cxt->fuzzy_string == 0 || STREQ (cxt->fuzzy_string, cxt->search_string) == 0)
+    {
+      FREE (cxt->fuzzy_string);
+      cxt->fuzzy_string = savestring (cxt->search_string);
+      cxt->nfuzzy = cxt->fuzzy_index = 0;
+      cxt->fuzzy_scan = cxt->search_string_index ? cxt->hlen - 2 : -1;
+      next = 0;
+    }
+
+  /* If the user typed ahead, we'll be back; show the best we've found. */
+  if (_rl_fuzzy_scan (cxt, cxt->lastc != -1 && cxt->lastc != -2) == 0)
+    {
+      _rl_fuzzy_show (cxt, _rl_fuzzy_best (cxt));
+      return 1;
+    }
+
+  if (next && cxt->nfuzzy)
+    {
+      next += cxt->fuzzy_index;
+      if (next < 0 || next >= cxt->nfuzzy)
+	rl_ding ();
+      else
+	cxt->fuzzy_index = next;
+    }
+
+  _rl_fuzzy_show (cxt, _rl_fuzzy_best (cxt));
+  return 1;
+}
+
 /* XXX - we could use _rl_bracketed_read_mbstring () here. */
 int
 _rl_search_getchar (_rl_search_cxt *cxt)
@@ -340,7 +1054,7 @@ _rl_isearch_dispatch (_rl_search_cxt *cxt, int c)
 {
   int n, wstart, wlen, limit, cval, incr;
   char *paste;
-  size_t pastelen;
+  size_t pastelen, len;
   int j;
   rl_command_func_t *f;
 
@@ -429,7 +1143,7 @@ add_character:
 	    f = cxt->keymap[_rl_to_lower (c)].function;
 	}
 
-      if (f == rl_reverse_search_history)
+      if (f == rl_reverse_search_history || f == rl_fuzzy_search_history)
 	cxt->lastc = (cxt->sflags & SF_REVERSE) ? -1 : -2;
       else if (f == rl_forward_search_history)
 	cxt->lastc = (cxt->sflags & SF_REVERSE) ? -2 : -1;
@@ -612,7 +1326,7 @@ opcode_dispatch:
       break;
 
     case -4:	/* C-G, abort */
-      rl_replace_line (cxt->lines[cxt->save_line], 0);
+      rl_replace_line (_rl_isearch_line (cxt, cxt->save_line, &len), 0);
       rl_point = cxt->save_point;
       rl_mark = cxt->save_mark;
       rl_deactivate_mark ();
@@ -725,6 +1439,14 @@ opcode_dispatch:
       break;
     }
 
+  if (cxt->sflags & SF_FUZZY)
+    {
+      cxt->keymap = cxt->okeymap = _rl_keymap;
+      return (_rl_fuzzy_search (cxt));
+    }
+
+  _rl_isearch_narrow (cxt);
+
   for (cxt->sflags &= ~(SF_FOUND|SF_FAILED);; )
     {
       if (cxt->search_string_index == 0)
@@ -761,7 +1483,7 @@ opcode_dispatch:
       do
 	{
 	  /* Move to the next line. */
-	  cxt->history_pos += cxt->direction;
+	  cxt->history_pos = _rl_isearch_next_line (cxt);
 
 	  /* At limit for direction? */
 	  if ((cxt->sflags & SF_REVERSE) ? (cxt->history_pos < 0) : (cxt->history_pos == cxt->hlen))
@@ -771,10 +1493,9 @@ opcode_dispatch:
 	    }
 
 	  /* We will need these later. */
-	  cxt->sline = cxt->lines[cxt->history_pos];
-	  cxt->sline_len = strlen (cxt->sline);
+	  _rl_isearch_set_sline (cxt, cxt->history_pos);
 	}
-      while ((cxt->prev_line_found && STREQ (cxt->prev_line_found, cxt->lines[cxt->history_pos])) ||
+      while ((cxt->prev_line_found && STREQ (cxt->prev_line_found, cxt->sline)) ||
 	     (cxt->search_string_index > cxt->sline_len));
 
       if (cxt->sflags & SF_FAILED)
@@ -807,8 +1528,8 @@ opcode_dispatch:
      the location. */
   if (cxt->sflags & SF_FOUND)
     {
-      cxt->prev_line_found = cxt->lines[cxt->history_pos];
-      rl_replace_line (cxt->lines[cxt->history_pos], 0);
+      cxt->prev_line_found = _rl_isearch_found_line (cxt, cxt->history_pos);
+      rl_replace_line (cxt->prev_line_found, 0);
       if (_rl_enable_active_region)
 	rl_activate_mark ();	
       rl_point = cxt->sline_index;
@@ -839,13 +1560,13 @@ _rl_isearch_cleanup (_rl_search_cxt *cxt, int r)
    DIRECTION is which direction to search; >= 0 means forward, < 0 means
    backwards. */
 static int
-rl_search_history (int direction, int invoking_key)
+rl_search_history (int direction, int invoking_key, int flags)
 {
   _rl_search_cxt *cxt;		/* local for now, but saved globally */
   int c, r;
 
   RL_SETSTATE(RL_STATE_ISEARCH);
-  cxt = _rl_isearch_init (direction);
+  cxt = _rl_isearch_init (direction, flags);
 
   rl_display_search (cxt->search_string, cxt->sflags, -1);
 
@@ -53,6 +53,9 @@
 #include "rlshell.h"
 #include "xmalloc.h"
 
+extern void _hs_clear_history_entries PARAMS((void));
+extern void _hs_replace_history_data PARAMS((int, histdata_t *, histdata_t *));
+
 static int rl_digit_loop PARAMS((void));
 static void _rl_history_set_point PARAMS((void));
 
@@ -453,14 +456,17 @@ _rl_revert_previous_lines (void)
 	    saved_undo_list = 0;
 	  /* Set up rl_line_buffer and other variables from history entry */
 	  rl_replace_from_history (entry, 0);	/* entry->line is now current */
-	  entry->data = 0;			/* entry->data is now current undo list */
+	  /* entry->data is now current undo list.  A snapshot of the history
+	     may share the entry, so let the history library clear it. */
+	  _hs_replace_history_data (where_history (), (histdata_t *)ul, (histdata_t *)NULL);
 	  /* Undo all changes to this history entry */
 	  while (rl_undo_list)
 	    rl_do_undo ();
 	  /* And copy the reverted line back to the history entry, preserving
-	     the timestamp. */
-	  FREE (entry->line);
-	  entry->line = savestring (rl_line_buffer);
+	     the timestamp.  Go through replace_history_entry so the history
+	     library's cached lengths and hashes stay current. */
+	  entry = replace_history_entry (where_history (), rl_line_buffer, (histdata_t)0);
+	  _rl_free_history_entry (entry);
 	}
       entry = previous_history ();
     }
@@ -512,12 +518,17 @@ rl_clear_history (void)
 	  if (ul == saved_undo_list)
 	    saved_undo_list = 0;
 	  _rl_free_undo_list (ul);
-	  hent->data = 0;
+	  /* This may give the history list its own copy of the entry, and
+	     of the list itself, if a snapshot shares them. */
+	  _hs_replace_history_data (i, (histdata_t *)ul, (histdata_t *)NULL);
+	  hlist = history_list ();
 	}
-      _rl_free_history_entry (hent);
     }
 
-  history_offset = history_length = 0;
+  /* Let the history library free the entries; their lines may be shared
+     or allocated in blocks.  Unlike clear_history, this keeps
+     history_base. */
+  _hs_clear_history_entries ();
   rl_undo_list = saved_undo_list;	/* should be NULL */
 }
 
@@ -527,11 +538,30 @@ rl_clear_history (void)
 /*								    */
 /* **************************************************************** */
 
+/* Add the lines other sessions have added to the shared history ring
+   since we last looked, staying on the same history entry, or on the
+   line being edited if we aren't on one. */
+void
+_rl_history_share_sync (void)
+{
+  int pos, at_end;
+
+  pos = history_base + where_history ();
+  at_end = where_history () == history_length;
+  if (history_share_sync () == 0)
+    return;
+  if (at_end || pos < history_base)
+    history_set_pos (history_length);
+  else
+    history_set_pos (pos - history_base);
+}
+
 /* Meta-< goes to the start of the history. */
 int
 rl_beginning_of_history (int count, int key)
 {
-  return (rl_get_previous_history (1 + where_history (), key));
+  _rl_history_share_sync ();
+  return (_rl_get_previous_history (1 + where_history ()));
 }
 
 /* Meta-> goes to the end of the history.  (The current line). */
@@ -547,11 +577,22 @@ rl_end_of_history (int count, int key)
 /* Move down to the next history line. */
 int
 rl_get_next_history (int count, int key)
+{
+  if (count != 0)
+    _rl_history_share_sync ();
+  return (_rl_get_next_history (count));
+}
+
+/* Move down COUNT history lines without looking for lines other sessions
+   have shared, for callers that have worked out COUNT from where we are
+   in the history list, which adding them could change. */
+int
+_rl_get_next_history (int count)
 {
   HIST_ENTRY *temp;
 
   if (count < 0)
-    return (rl_get_previous_history (-count, key));
+    return (_rl_get_previous_history (-count));
 
   if (count == 0)
     return 0;
@@ -585,14 +626,24 @@ rl_get_next_history (int count, int key)
    line.  If there is no previous history, just ding. */
 int
 rl_get_previous_history (int count, int key)
+{
+  if (count != 0)
+    _rl_history_share_sync ();
+  return (_rl_get_previous_history (count));
+}
+
+/* Move up COUNT history lines without looking for lines other sessions
+   have shared; see _rl_get_next_history. */
+int
+_rl_get_previous_history (int count)
 {
   HIST_ENTRY *old_temp, *temp;
   int had_saved_line;
 
   if (count < 0)
-    return (rl_get_next_history (-count, key));
+    return (_rl_get_next_history (-count));
 
-  if (count == 0 || history_list () == 0)
+  if (count == 0 || (history_length == 0 && history_list () == 0))
     return 0;
 
   /* either not saved by rl_newline or at end of line, so set appropriately. */
@@ -653,9 +704,10 @@ set_saved_history ()
 
   if (saved_history_logical_offset >= 0)
     {
+      _rl_history_share_sync ();
       absolute_offset = saved_history_logical_offset - history_base;
       count = where_history () - absolute_offset;
-      rl_get_previous_history (count, 0);
+      _rl_get_previous_history (count);
     }
   saved_history_logical_offset = -1;
   _rl_internal_startup_hook = _rl_saved_internal_startup_hook;
@@ -186,6 +186,7 @@ extern int rl_paste_from_clipboard PARAMS((int, int));
 /* Bindable commands for incremental searching. */
 extern int rl_reverse_search_history PARAMS((int, int));
 extern int rl_forward_search_history PARAMS((int, int));
+extern int rl_fuzzy_search_history PARAMS((int, int));
 
 /* Bindable keyboard macro commands. */
 extern int rl_start_kbd_macro PARAMS((int, int));
@@ -67,6 +67,30 @@
 #define SF_CHGKMAP		0x08
 #define SF_PATTERN		0x10
 #define SF_NOCASE		0x20		/* unused so far */
+#define SF_FUZZY		0x40		/* ranked subsequence search */
+
+/* The lines of the history that contain a search string.  Of the lines
+   [LO, HI) of the search context's lines, LINES[FIRST..LAST) are the
+   ones that matched, in ascending order.  The search context keeps one
+   of these for each length of the search string, longest first. */
+typedef struct __rl_search_set
+{
+  struct __rl_search_set *next;	/* set for a shorter search string */
+  int len;			/* length of the search string */
+  int lo, hi;
+  int *lines;
+  int first, last, size;
+} _rl_search_set;
+
+/* A line a fuzzy search matched, and how well.  START and END delimit
+   the shortest part of the line containing the search string's
+   characters in order. */
+typedef struct __rl_fuzzy_match
+{
+  int line;
+  int score;
+  int start, end;
+} _rl_fuzzy_match;
 
 typedef struct  __rl_search_context
 {
@@ -77,17 +101,31 @@ typedef struct  __rl_search_context
   int search_string_index;
   int search_string_size;
 
-  char **lines;
+  int hfirst;			/* history_get offset of the first line searched */
+  char *input_line;		/* line being edited, searched after the history */
   char *allocated_line;    
   int hlen;
   int hindex;
 
+  _rl_search_set *matches;	/* lines matching the search string */
+
+  _rl_fuzzy_match *fuzzy;	/* best fuzzy matches; a heap until sorted */
+  int nfuzzy;
+  int fuzzy_index;		/* the one being shown */
+  int fuzzy_scan;		/* next line to score, or -1 when done */
+  char *fuzzy_string;		/* search string they were ranked for */
+
   int save_point;
   int save_mark;
   int save_line;
   int last_found_line;
   char *prev_line_found;
 
+  char *sline_copy;		/* sline and prev_line_found, when they are */
+  size_t sline_copy_size;	/* lines history_lazy_read hasn't made */
+  char *found_copy;
+  size_t found_copy_size;
+
   UNDO_LIST *save_undo_list;
 
   Keymap keymap;	/* used when dispatching commands in search string */
@@ -348,6 +386,9 @@ extern int _rl_arg_callback PARAMS((_rl_arg_cxt));
 extern void _rl_reset_argument PARAMS((void));
 
 extern void _rl_start_using_history PARAMS((void));
+extern void _rl_history_share_sync PARAMS((void));
+extern int _rl_get_next_history PARAMS((int));
+extern int _rl_get_previous_history PARAMS((int));
 extern int _rl_free_saved_history_line PARAMS((void));
 extern void _rl_set_insert_mode PARAMS((int, int));
 
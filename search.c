@@ -216,6 +216,7 @@ _rl_nsearch_init (int dir, int pchar)
   _rl_search_cxt *cxt;
   char *p;
 
+  _rl_history_share_sync ();
   cxt = _rl_scxt_alloc (RL_SEARCH_NSEARCH, 0);
   if (dir < 0)
     cxt->sflags |= SF_REVERSE;		/* not strictly needed */
@@ -599,6 +600,7 @@ rl_history_search_reinit (int flags)
 {
   int sind;
 
+  _rl_history_share_sync ();
   rl_history_search_pos = where_history ();
   rl_history_search_len = rl_point;
   rl_history_search_flags = flags;
@@ -46,6 +46,8 @@
 
 #include "rlprivate.h"
 
+extern void _hs_replace_history_data PARAMS((int, histdata_t *, histdata_t *));
+
 #if defined (HANDLE_SIGNALS)
 
 #if !defined (RETSIGTYPE)
@@ -620,7 +622,7 @@ rl_free_line_state (void)
 
   entry = current_history ();
   if (entry)
-    entry->data = (char *)NULL;
+    _hs_replace_history_data (where_history (), (histdata_t *)entry->data, (histdata_t *)NULL);
 
   _rl_kill_kbd_macro ();
   rl_clear_message ();
@@ -346,11 +346,12 @@ rl_vi_fetch_history (int count, int c)
      output of `history'. */
   if (rl_explicit_arg)
     {
+      _rl_history_share_sync ();
       wanted = history_base + where_history () - count;
       if (wanted <= 0)
         rl_beginning_of_history (0, 0);
       else
-        rl_get_previous_history (wanted, c);
+        _rl_get_previous_history (wanted);
     }
   else
     rl_beginning_of_history (count, 0);